@@ -0,0 +1,111 @@
+#!/bin/sh
+# Compile-time benchmarks, run from the repository root:
+#
+#     bench/compile.sh [section...]
+#
+# With no section every one runs. $FUNCOC is the compiler to measure,
+# ./funcoc by default. Times are wall clock in milliseconds, the best of
+# $RUNS runs (3 by default).
+#
+#     scaling    one function with 125k to 1M statements, and 125k to 1M
+#                top-level functions; fails unless the time per item at
+#                1M is within twice the time per item at 125k
+#     backends   latency of a debug build to an object file (-c) through
+#                qbe and as, against --backend x86 straight into as
+#     pipeline   throughput of the sequential compiler against --pipeline
+#                and against lexing on 4 threads
+
+FUNCOC=${FUNCOC:-./funcoc}
+RUNS=${RUNS:-3}
+status=0
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# best wall time in ms of running the command $RUNS times, output
+# discarded, or "failed"
+best()
+{
+    min=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        if ! "$@" > /dev/null 2>&1; then
+            echo failed
+            return
+        fi
+        end=$(date +%s%N)
+        ms=$(((end - start) / 1000000))
+        if [ -z "$min" ] || [ $ms -lt $min ]; then
+            min=$ms
+        fi
+        i=$((i + 1))
+    done
+    echo $min
+}
+
+scaling()
+{
+    printf '%-12s %8s %8s %10s\n' kind items ms ns/item
+    for kind in statements functions; do
+        first=
+        for n in 125000 250000 500000 1000000; do
+            bench/gen.sh $kind $n > "$tmp/scaling.fc"
+            ms=$(best "$FUNCOC" "$tmp/scaling.fc")
+            per=$((ms * 1000000 / n))
+            printf '%-12s %8d %8d %10d\n' $kind $n $ms $per
+            if [ -z "$first" ]; then
+                first=$per
+            fi
+        done
+        if [ $per -gt $((first * 2)) ]; then
+            echo "$kind: not linear, $per ns per item at 1M against $first at 125k"
+            status=1
+        fi
+    done
+}
+
+backends()
+{
+    qbe=$(command -v "${QBE:-qbe}")
+    printf '%-20s %8s %8s\n' input qbe x86
+    for input in "statements 10000" "statements 100000" "functions 10000" "functions 100000"; do
+        bench/gen.sh $input > "$tmp/backends.fc"
+        x86=$(best "$FUNCOC" --backend x86 -c -o "$tmp/backends.o" "$tmp/backends.fc")
+        if [ -n "$qbe" ]; then
+            viaQbe=$(best "$FUNCOC" -c -o "$tmp/backends.o" "$tmp/backends.fc")
+        else
+            viaQbe=-
+        fi
+        printf '%-20s %8s %8s\n' "$input" $viaQbe $x86
+    done
+    if [ -z "$qbe" ]; then
+        echo "qbe not found, only the x86 backend was timed"
+    fi
+}
+
+pipeline()
+{
+    printf '%-20s %10s %6s %10s %6s %10s %6s\n' input sequential MB/s pipeline MB/s lex-4 MB/s
+    for input in "statements 500000" "functions 500000"; do
+        bench/gen.sh $input > "$tmp/pipeline.fc"
+        bytes=$(wc -c < "$tmp/pipeline.fc")
+        line=$(printf '%-20s' "$input")
+        for mode in "" --pipeline "--lex-threads 4"; do
+            ms=$(best "$FUNCOC" $mode "$tmp/pipeline.fc")
+            rate=-
+            if [ "$ms" != failed ] && [ "$ms" -gt 0 ]; then
+                rate=$((bytes / 1000 / ms))
+            fi
+            line="$line $(printf '%10s %6s' $ms $rate)"
+        done
+        echo "$line"
+    done
+}
+
+sections=${*:-scaling backends pipeline}
+for section in $sections; do
+    echo "== $section"
+    $section
+done
+exit $status
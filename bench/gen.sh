@@ -0,0 +1,54 @@
+#!/bin/sh
+# Writes a generated funcoc program to stdout, for the benchmarks and the
+# large-input checks:
+#
+#     bench/gen.sh statements N    entry with N statements
+#     bench/gen.sh functions N     N top-level functions and an entry
+#     bench/gen.sh nested N        a value nested N deep in calls, indices
+#                                  and parenthesized comparisons
+
+case "$1" in
+statements)
+    awk -v n="$2" 'BEGIN {
+        print "fn entry() {"
+        print "    x: int = 5 + 3;"
+        for (i = 0; i < n; i++) {
+            if (i % 2 == 0) {
+                printf "    y%d: int = x + %d;\n", i, i
+            } else {
+                printf "    print(toString(y%d + %d));\n", i - 1, i
+            }
+        }
+        print "}"
+    }'
+    ;;
+functions)
+    awk -v n="$2" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            printf "fn f%d(a: int): int {\n    return a + %d;\n}\n", i, i
+        }
+        print "fn entry() {"
+        printf "    print(toString(f%d(1)));\n", n - 1
+        print "}"
+    }'
+    ;;
+nested)
+    awk -v n="$2" 'BEGIN {
+        print "fn id(x: int): int {\n    return x;\n}"
+        print "fn entry() {"
+        print "    a: int[2];"
+        print "    a[0] = 0;"
+        print "    a[1] = 1;"
+        for (i = 0; i < n; i++) {
+            left = left (i % 3 == 0 ? "id(" : i % 3 == 1 ? "a[" : "(1 < ")
+            right = (i % 3 == 1 ? "]" : ")") right
+        }
+        printf "    print(toString(%s0%s));\n", left, right
+        print "}"
+    }'
+    ;;
+*)
+    echo "usage: $0 statements|functions|nested N" >&2
+    exit 1
+    ;;
+esac
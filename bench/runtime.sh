@@ -0,0 +1,87 @@
+#!/bin/sh
+# Runtime benchmarks for compiled programs, run from the repository root:
+#
+#     bench/runtime.sh [program...]
+#
+# Each bench/runtime/<program>.fc is built through qbe and through
+# --backend x86, next to its hand-written C baseline <program>.c built
+# with $CC -O2. All three are run with output to /dev/null and timed:
+# wall clock in milliseconds, the best of $RUNS runs (3 by default). An
+# --instrument build is then run once for the runtime's own counters:
+# dputs writev calls and bytes, itos calls, and arena_alloc calls, bytes
+# and malloc'd chunks.
+#
+# $FUNCOC is the compiler, ./funcoc by default. The stdlib is QBE IL, so
+# this needs qbe ($QBE, or qbe from PATH).
+
+FUNCOC=${FUNCOC:-./funcoc}
+CC=${CC:-cc}
+RUNS=${RUNS:-3}
+status=0
+
+if ! command -v "${QBE:-qbe}" > /dev/null; then
+    echo "qbe not found"
+    exit 1
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+export XDG_CACHE_HOME="$tmp/cache"
+
+# best wall time in ms of running the program $RUNS times
+best()
+{
+    min=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        "$1" > /dev/null
+        end=$(date +%s%N)
+        ms=$(((end - start) / 1000000))
+        if [ -z "$min" ] || [ $ms -lt $min ]; then
+            min=$ms
+        fi
+        i=$((i + 1))
+    done
+    echo $min
+}
+
+programs=$*
+if [ -z "$programs" ]; then
+    for src in bench/runtime/*.fc; do
+        programs="$programs $(basename "$src" .fc)"
+    done
+fi
+
+printf '%-12s %8s %8s %8s %10s\n' program qbe x86 C qbe/C
+for program in $programs; do
+    src=bench/runtime/$program
+    if ! "$FUNCOC" -o "$tmp/$program-qbe" "$src.fc" ||
+       ! "$FUNCOC" --backend x86 -o "$tmp/$program-x86" "$src.fc" ||
+       ! "$FUNCOC" --instrument -o "$tmp/$program-prof" "$src.fc" ||
+       ! "$CC" -O2 -o "$tmp/$program-c" "$src.c"; then
+        echo "$program: build failed"
+        status=1
+        continue
+    fi
+
+    # the baseline has to do the same work
+    "$tmp/$program-c" > "$tmp/expected"
+    for build in qbe x86; do
+        "$tmp/$program-$build" > "$tmp/out"
+        if ! cmp -s "$tmp/expected" "$tmp/out"; then
+            echo "$program: --backend $build output differs from the C baseline"
+            status=1
+        fi
+    done
+
+    qbe=$(best "$tmp/$program-qbe")
+    x86=$(best "$tmp/$program-x86")
+    c=$(best "$tmp/$program-c")
+    ratio=$(awk -v a="$qbe" -v b="$c" 'BEGIN { printf "%.2f", (b > 0 ? a / b : 0) }')
+    printf '%-12s %8d %8d %8d %10s\n' "$program" "$qbe" "$x86" "$c" "$ratio"
+
+    FUNCOC_PROF="$tmp/$program.prof" "$tmp/$program-prof" > /dev/null
+    grep '^#' "$tmp/$program.prof" | sed "s/^#/    /"
+done
+exit $status
@@ -0,0 +1,76 @@
+#include <stdio.h>
+
+static const char text[] =
+    "01: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "02: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "03: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "04: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "05: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "06: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "07: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "08: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "09: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "10: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "11: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "12: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "13: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "14: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "15: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "16: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "17: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "18: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "19: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "20: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "21: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "22: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "23: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "24: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "25: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "26: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "27: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "28: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "29: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "30: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "31: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "32: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "33: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "34: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "35: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "36: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "37: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "38: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "39: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "40: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "41: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "42: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "43: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "44: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "45: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "46: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "47: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "48: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "49: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "50: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "51: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "52: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "53: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "54: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "55: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "56: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "57: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "58: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "59: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "60: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "61: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "62: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "63: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.\n"
+    "64: Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.";
+
+int main(void)
+{
+    for (int i = 0; i < 200000; i++)
+    {
+        puts(text);
+    }
+    return 0;
+}
@@ -0,0 +1,10 @@
+#include <stdio.h>
+
+int main(void)
+{
+    for (int i = 0; i < 1000000; i++)
+    {
+        puts("the quick brown fox jumps over the lazy dog");
+    }
+    return 0;
+}
@@ -0,0 +1,10 @@
+#include <stdio.h>
+
+int main(void)
+{
+    for (int i = 0; i < 1000000; i++)
+    {
+        printf("%d %d\n", i, i + i);
+    }
+    return 0;
+}
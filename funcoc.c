@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
@@ -5,1317 +6,7549 @@
 #include <stdbool.h>
 #include <bsd/string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "funcoc.h"
 
-static char *IdentifierStr = NULL;
-static int NumVal;
-static int LastChar = ' ';
-static FILE *fptr = NULL;
 static char *AnonExpr = "__anon_expr";
-static int Depth = 0;
-static char **stringLiterals = {};
-static int curLit = 0;
 
 static char var = 'v';
 
-const char *padding[3] = { "    ", "        " };
-
-enum Token {
-    tok_eof = -1,
-    tok_fn = -2,
-    tok_identifier = -3,
-    tok_expose = -4,
-    tok_reserve = -5,
-    tok_hide = -6,
-    tok_int = -7,
-    tok_equals = -8,
-    tok_declaration = -9,
-    tok_assignment = -10,
-    tok_binop = -11,
-    tok_quo = -12
-};
-
-typedef struct VarRefKeyValue
+typedef struct AllocSite
 {
-    char *Key;
-    char *Val;
-} VarRefKeyValue;
-
-typedef struct VarRefMap
+    const char *name;
+    size_t allocs;
+    size_t reallocs;
+    size_t frees;
+    size_t bytes;
+} AllocSite;
+
+typedef struct AllocStats
 {
-    struct VarRefKeyValue *map;
-    size_t size;
-    size_t allocated;
-} VarRefMap;
+    struct AllocSite *sites;
+    size_t numSites;
+    size_t sitesAllocated;
+    size_t untracked;   // calls whose site could not be added to sites
+    size_t allocs;
+    size_t reallocs;
+    size_t frees;
+    size_t totalBytes;
+    size_t liveBytes;
+    size_t peakBytes;
+} AllocStats;
+
+static struct AllocStats allocStats = { .numSites = 0 };
+static pthread_mutex_t allocStatsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// --stats, off unless main turns it on. When off an allocation costs a
+// relaxed load on top of the real one and never takes the lock.
+static atomic_bool allocStatsEnabled;
+
+// every block carries its size in front so frees can be accounted for,
+// and whether it was counted so blocks from before --stats took effect
+// are not subtracted
+typedef union AllocHeader
+{
+    struct
+    {
+        size_t size;
+        bool counted;
+    };
+    max_align_t align;
+} AllocHeader;
 
-static struct VarRefMap varMap = { .map = NULL, .size = 0, .allocated = 0 };
+static bool AllocStats_enabled()
+{
+    return atomic_load_explicit(&allocStatsEnabled, memory_order_relaxed);
+}
 
-void VarRefMap_add(struct VarRefMap *map, struct VarRefKeyValue keyVal)
+static struct AllocSite *AllocStats_site(const char *name)
 {
-    if (map->allocated == 0)
+    for (size_t i = 0; i < allocStats.numSites; i++)
     {
-        struct VarRefKeyValue *temp = malloc(sizeof(struct VarRefKeyValue) * 8);
-        map->allocated = 8;
-        map->map = temp;
+        // __func__ is a unique static array per function, pointer compare is enough
+        if (allocStats.sites[i].name == name)
+        {
+            return &allocStats.sites[i];
+        }
     }
-    struct VarRefKeyValue *mod = map->map + map->size;
-    *mod = keyVal;
-    map->size++;
-}
 
-static char *VarRefMap_getValue(struct VarRefMap *map, char *key)
-{
-    struct VarRefKeyValue *iter = map->map;
-    for (int i = 0; i < map->size; i++)
+    // grown with the real realloc, the table is not counted itself
+    if (allocStats.numSites == allocStats.sitesAllocated)
     {
-        struct VarRefKeyValue chk = *iter++;
-        if (strcmp(chk.Key, key) == 0)
+        size_t allocated = allocStats.sitesAllocated == 0 ? 64 : allocStats.sitesAllocated * 2;
+        struct AllocSite *sites = realloc(allocStats.sites, sizeof(struct AllocSite) * allocated);
+        if (sites == NULL)
         {
-            return chk.Val;
+            return NULL;
         }
+        allocStats.sites = sites;
+        allocStats.sitesAllocated = allocated;
     }
 
-    return NULL;
+    struct AllocSite *site = &allocStats.sites[allocStats.numSites++];
+    *site = (struct AllocSite) { .name = name };
+    return site;
 }
 
-void printPad(char *format, ...)
+static void AllocStats_grow(size_t size)
 {
-    va_list args;
-    if (Depth > 0)
+    allocStats.totalBytes += size;
+    allocStats.liveBytes += size;
+    if (allocStats.liveBytes > allocStats.peakBytes)
     {
-        printf("%s", padding[Depth-1]);
+        allocStats.peakBytes = allocStats.liveBytes;
     }
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
 }
 
-static char* appendStringAlloc(char *str, char character) {
-    char *newString, *ptr;
-
-    size_t length;
-
-    if (str == NULL)
-    {
-        length = 2;
-    } else
+static void *Stats_malloc(size_t size, const char *site)
+{
+    union AllocHeader *block = malloc(sizeof(union AllocHeader) + size);
+    if (block == NULL)
     {
-        length = strlen(str) + 2;
+        return NULL;
     }
-
-    if ((newString = calloc(length, sizeof(char))) == NULL)
+    block->size = size;
+    block->counted = AllocStats_enabled();
+    if (!block->counted)
     {
-        printf("Error allocating memory.\n");
-        exit(-1);
+        return block + 1;
     }
 
-    ptr = newString;
-
-    if (str != NULL)
+    pthread_mutex_lock(&allocStatsLock);
+    struct AllocSite *s = AllocStats_site(site);
+    if (s != NULL)
     {
-        for (char c = *str; c != '\0'; c = *++str)
-        {
-            *ptr = c;
-            ptr++;
-        }
+        s->allocs++;
+        s->bytes += size;
+    } else
+    {
+        allocStats.untracked++;
     }
+    allocStats.allocs++;
+    AllocStats_grow(size);
+    pthread_mutex_unlock(&allocStatsLock);
 
-    *ptr = character;
-    ptr++;
-    *ptr = '\0';
-
-    return newString;
+    return block + 1;
 }
 
-static char nextChar()
+static void *Stats_calloc(size_t count, size_t size, const char *site)
 {
-    char c = getc(fptr);
-    LastChar = c;
-    return c;
+    void *ptr = Stats_malloc(count * size, site);
+    if (ptr != NULL)
+    {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
 }
 
-static int gettok(FILE *fptr) {
-
-    if (fptr == NULL)
+static void *Stats_realloc(void *ptr, size_t size, const char *site)
+{
+    if (ptr == NULL)
     {
-        printf("null file pointer");
-        exit(-1);
+        return Stats_malloc(size, site);
     }
 
-    while (isspace(LastChar)) {
-        LastChar = getc(fptr);
+    union AllocHeader *block = (union AllocHeader *)ptr - 1;
+    size_t oldSize = block->size;
+    union AllocHeader *temp = realloc(block, sizeof(union AllocHeader) + size);
+    if (temp == NULL)
+    {
+        return NULL;
     }
-
-    if (LastChar == '"')
+    temp->size = size;
+    if (!temp->counted)
     {
-        return tok_quo;
+        return temp + 1;
     }
 
-    if (LastChar == '=')
+    pthread_mutex_lock(&allocStatsLock);
+    struct AllocSite *s = AllocStats_site(site);
+    if (s != NULL)
+    {
+        s->reallocs++;
+    } else
+    {
+        allocStats.untracked++;
+    }
+    allocStats.reallocs++;
+    if (size > oldSize)
     {
-        LastChar = getc(fptr);
-        if (LastChar == '=')
+        if (s != NULL)
         {
-            LastChar = getc(fptr);
-            return tok_equals;
+            s->bytes += size - oldSize;
         }
-        return tok_assignment;
+        AllocStats_grow(size - oldSize);
+    } else
+    {
+        allocStats.liveBytes -= oldSize - size;
     }
+    pthread_mutex_unlock(&allocStatsLock);
 
-    if (isalpha(LastChar)) {
-        char *newString = calloc(2, sizeof(char));
-        if (newString == NULL) {
-            exit(-1);
-        }
-        newString[0] = LastChar;
-
-        LastChar = getc(fptr);
-        while (isalnum(LastChar)) {
-            char *appendedStr = appendStringAlloc(newString, LastChar);
-            free(newString);
-            newString = appendedStr;
-            LastChar = getc(fptr);
-        }
-
-        IdentifierStr = newString;
-
-        if (LastChar == ':') {
-            LastChar = getc(fptr); // eat :
-            return tok_declaration;
-        }
+    return temp + 1;
+}
 
-        if (strcmp(IdentifierStr, "fn") == 0) {
-            free(IdentifierStr);
-            return tok_fn;
-        }
+static void Stats_free(void *ptr, const char *site)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
 
-        if (strcmp(IdentifierStr, "expose") == 0) {
-            free(IdentifierStr);
-            return tok_expose;
+    union AllocHeader *block = (union AllocHeader *)ptr - 1;
+    if (block->counted)
+    {
+        pthread_mutex_lock(&allocStatsLock);
+        struct AllocSite *s = AllocStats_site(site);
+        if (s != NULL)
+        {
+            s->frees++;
+        } else
+        {
+            allocStats.untracked++;
         }
-
-        return tok_identifier;
+        allocStats.frees++;
+        allocStats.liveBytes -= block->size;
+        pthread_mutex_unlock(&allocStatsLock);
     }
+    free(block);
+}
+
+#define malloc(size) Stats_malloc((size), __func__)
+#define calloc(count, size) Stats_calloc((count), (size), __func__)
+#define realloc(ptr, size) Stats_realloc((ptr), (size), __func__)
+#define free(ptr) Stats_free((ptr), __func__)
 
-    if (isdigit(LastChar)) {
-        char *numString = calloc(2, sizeof(char));
+enum Token {
+    tok_eof = -1,
+    tok_fn = -2,
+    tok_identifier = -3,
+    tok_expose = -4,
+    tok_reserve = -5,
+    tok_hide = -6,
+    tok_int = -7,
+    tok_equals = -8,
+    tok_declaration = -9,
+    tok_assignment = -10,
+    tok_binop = -11,
+    tok_quo = -12,
+    tok_return = -13,
+    tok_rawline = -14,
+    tok_if = -15,
+    tok_else = -16,
+    tok_likely = -17,
+    tok_unlikely = -18,
+    tok_notEquals = -19,
+    tok_lessEquals = -20,
+    tok_greaterEquals = -21
+};
 
-        do {
-            char *newString = appendStringAlloc(numString, LastChar);
-            free(numString);
-            numString = newString;
-            LastChar = getc(fptr);
-        } while (isdigit(LastChar) );
+static _Noreturn void compileError(const char *fmt, ...);
 
-        NumVal = atoi(numString);
-        free(numString);
-        return tok_int;
+static char *copyString(const char *str)
+{
+    if (str == NULL)
+    {
+        return NULL;
+    }
+    size_t len = strlen(str) + 1;
+    char *copy = malloc(len);
+    if (copy == NULL)
+    {
+        compileError("error allocating memory");
     }
+    memcpy(copy, str, len);
+    return copy;
+}
 
-    if (LastChar == EOF) {
-        return tok_eof;
+// Returns items resized to hold at least size elements. The capacity
+// doubles, so appending n elements one at a time costs O(n) overall.
+// Growth is accounted to the caller's allocation site.
+static void *Vec_grow(void *items, size_t *allocated, size_t size, size_t elemSize, const char *site)
+{
+    if (size <= *allocated)
+    {
+        return items;
     }
 
-    int thisChar = LastChar;
-    LastChar = getc(fptr);
+    size_t count = *allocated == 0 ? 8 : *allocated;
+    while (count < size)
+    {
+        count *= 2;
+    }
 
-    return thisChar;
+    void *temp = count > SIZE_MAX / elemSize ? NULL : Stats_realloc(items, count * elemSize, site);
+    if (temp == NULL)
+    {
+        compileError("error allocating memory");
+    }
+    *allocated = count;
+    return temp;
 }
 
+#define VEC_RESERVE(items, allocated, size) \
+    ((items) = Vec_grow((items), &(allocated), (size), sizeof(*(items)), __func__))
 
-typedef struct exp_body { struct Exp **exprs; int numExprs; } exp_body;
-enum context 
-{
-    none,
-    reference,
-    assignment
-};
-
-enum context Context = none;
-
-typedef struct Exp Exp;
-struct Exp
-{
-    enum EXP {
-        exp_int,
-        exp_var,
-        exp_add,
-        exp_call,
-        exp_prototype,
-        exp_function,
-        exp_assignment,
-        exp_declaration,
-        exp_stringlit
-    } tag;
-    union {
-        struct exp_int { int val; } exp_int;
-        struct exp_var { char *name; } exp_var;
-        struct exp_add { struct Exp *left; struct Exp *right; } exp_add;
-        struct exp_call { char *callee; Exp** args; int numArgs; } exp_call;
-        struct exp_prototype { char *name; char **args; int numArgs; } exp_prototype;
-        struct exp_function { struct exp_prototype *proto; struct exp_body *body; } exp_function;
-        struct exp_assignment { struct Exp *target; struct Exp *right; } exp_assignment;
-        struct exp_declaration { char *type; char *name; } exp_declaration;
-        struct exp_stringlit { int literalId; } exp_stringlit;
-    };
-};
+#define VEC_PUSH(items, size, allocated, item) \
+    do \
+    { \
+        VEC_RESERVE((items), (allocated), (size) + 1); \
+        (items)[(size)++] = (item); \
+    } while (0)
 
-Exp *Exp_new(Exp exp)
+typedef struct StrMapEntry
 {
-    Exp *ptr = malloc(sizeof(Exp));
-    if (ptr) *ptr = exp;
-    return ptr;
-}
+    char *key;
+    long val;
+} StrMapEntry;
 
-void Exp_printPrototype(struct exp_prototype *proto)
+// open addressing string -> long map, keys are copied
+typedef struct StrMap
 {
-    if (proto == NULL)
-        return;
+    struct StrMapEntry *entries;
+    size_t size;
+    size_t allocated;
+} StrMap;
 
-    struct exp_prototype protostruct = *proto;
-    char *protoName = protostruct.name;
-    printf("%s(", protoName);
-    int numArgs = proto->numArgs;
-    for (int i = 0; i < numArgs; i++)
+#define HASH_SEED 14695981039346656037UL
+
+// FNV-1a, continuing from hash
+static size_t hashBytes(size_t hash, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
     {
-        printf("%s", proto->args[i]);
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211UL;
     }
-    printf(")");
+    return hash;
 }
 
-void FreeProto(struct exp_prototype *proto)
+static size_t hashString(const char *str)
 {
-    if (proto == NULL)
-        return;
+    return hashBytes(HASH_SEED, str, strlen(str));
+}
 
-    if (proto->args != NULL)
+static struct StrMapEntry *StrMap_find(struct StrMap *map, const char *key)
+{
+    size_t mask = map->allocated - 1;
+    for (size_t i = hashString(key) & mask; ; i = (i + 1) & mask)
     {
-        int numArgs = proto->numArgs;
-        for (int i = 0; i < numArgs; i++)
+        struct StrMapEntry *entry = &map->entries[i];
+        if (entry->key == NULL || strcmp(entry->key, key) == 0)
         {
-            free(proto->args[i]);
+            return entry;
         }
-        free(proto->args);
     }
-    free(proto->name);
-    free(proto);
-    return;
 }
 
-void Exp_Free(struct Exp *exp)
+static long *StrMap_get(struct StrMap *map, const char *key)
 {
-    if (!exp)
+    if (map->size == 0)
     {
-        return;
-    }
-
-    if(exp == NULL)
-    {
-        return;
+        return NULL;
     }
+    struct StrMapEntry *entry = StrMap_find(map, key);
+    return entry->key == NULL ? NULL : &entry->val;
+}
 
-    if (exp->tag == exp_function)
+static void StrMap_set(struct StrMap *map, const char *key, long val)
+{
+    if ((map->size + 1) * 2 > map->allocated)
     {
-        struct exp_prototype *proto = exp->exp_function.proto;
-        FreeProto(proto);
-        exp_body *body = exp->exp_function.body;
-        for (int i = 0; i < body->numExprs; i++)
+        struct StrMap grown = { .size = map->size, .allocated = map->allocated == 0 ? 16 : map->allocated * 2 };
+        grown.entries = calloc(grown.allocated, sizeof(struct StrMapEntry));
+        if (grown.entries == NULL)
         {
-            Exp_Free(body->exprs[i]);
+            compileError("error allocating memory");
         }
-        free(body->exprs);
-        free(body);
-        free(exp);
-        return;
+        for (size_t i = 0; i < map->allocated; i++)
+        {
+            if (map->entries[i].key != NULL)
+            {
+                *StrMap_find(&grown, map->entries[i].key) = map->entries[i];
+            }
+        }
+        free(map->entries);
+        *map = grown;
     }
-    
-    if (exp->tag == exp_prototype)
+
+    struct StrMapEntry *entry = StrMap_find(map, key);
+    if (entry->key == NULL)
     {
-        struct exp_prototype proto = exp->exp_prototype;
-        free(proto.args);
-        free(proto.name);
-        free(exp);
-        return;
+        entry->key = copyString(key);
+        map->size++;
     }
+    entry->val = val;
+}
 
-    if (exp->tag == exp_declaration)
+static void StrMap_free(struct StrMap *map)
+{
+    for (size_t i = 0; i < map->allocated; i++)
     {
-        free(exp->exp_declaration.name);
-        free(exp->exp_declaration.type);
-        free(exp);
-        return;
+        free(map->entries[i].key);
     }
+    free(map->entries);
+    *map = (struct StrMap) { .entries = NULL, .size = 0, .allocated = 0 };
+}
+
+typedef struct VarRefKeyValue
+{
+    char *Key;
+    char *Val;
+} VarRefKeyValue;
+
+// Variable types by name. Keys and values are owned copies; a later
+// declaration of the same name shadows the earlier one.
+typedef struct VarRefMap
+{
+    struct VarRefKeyValue *map;
+    size_t size;
+    size_t allocated;
+    struct StrMap index;
+} VarRefMap;
 
-    if (exp->tag == exp_assignment)
+void VarRefMap_add(struct VarRefMap *map, struct VarRefKeyValue keyVal)
+{
+    keyVal.Key = copyString(keyVal.Key);
+    keyVal.Val = copyString(keyVal.Val);
+    StrMap_set(&map->index, keyVal.Key, map->size);
+    VEC_PUSH(map->map, map->size, map->allocated, keyVal);
+}
+
+static char *VarRefMap_getValue(struct VarRefMap *map, char *key)
+{
+    long *idx = StrMap_get(&map->index, key);
+    if (idx == NULL)
     {
-        Exp_Free(exp->exp_assignment.target);
-        Exp_Free(exp->exp_assignment.right);
-        free(exp);
-        return;
+        return NULL;
     }
 
-    if (exp->tag == exp_int)
+    return map->map[*idx].Val;
+}
+
+static void VarRefMap_free(struct VarRefMap *map)
+{
+    for (size_t i = 0; i < map->size; i++)
     {
-        free(exp);
-        return;
+        free(map->map[i].Key);
+        free(map->map[i].Val);
     }
+    free(map->map);
+    StrMap_free(&map->index);
+    *map = (struct VarRefMap) { .map = NULL, .size = 0, .allocated = 0 };
+}
 
-    if (exp->tag == exp_var)
+static char *readFile(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
     {
-        free(exp->exp_var.name);
-        free(exp);
-        return;
+        return NULL;
     }
 
-    if (exp->tag == exp_add)
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *text = malloc(length + 1);
+    if (text == NULL)
     {
-        Exp_Free(exp->exp_add.left);
-        Exp_Free(exp->exp_add.right);
-        free(exp);
-        return;
+        compileError("error allocating memory");
     }
+    size_t read = fread(text, 1, length, file);
+    text[read] = '\0';
+    fclose(file);
 
-    if (exp->tag == exp_call)
+    if (size != NULL)
     {
-        free(exp->exp_call.callee);
-        int numArgs = exp->exp_call.numArgs;
-        for (int i = 0; i < numArgs; i++)
-        {
-            Exp_Free(exp->exp_call.args[i]);
-        }
-        free(exp->exp_call.args);
-        free(exp);
-        return;
+        *size = read;
     }
+    return text;
 }
 
-char *concat(char *s1, char *s2)
+// Tokens of the whole file, one array per field. offset and length index
+// into Source: the identifier name for identifiers and declarations, the
+// contents between the quotes for string literals, the rest of the line
+// after the \\ of raw literal lines. value is the number for integers and
+// nonzero for string literals with escapes. line and column are 1-based
+// and locate the first character of the token.
+typedef struct TokenBuffer
 {
-    char *res = malloc(strlen(s1) + strlen(s2) + 1);
-    strlcpy(res, s1, strlen(res) + 1);
-    strlcat(res, s2, strlen(res) + strlen(s2) + 1);
-    return res;
-}
+    int16_t *kind;
+    uint32_t *offset;
+    uint32_t *length;
+    int32_t *value;
+    uint32_t *line;
+    uint32_t *column;
+    size_t size;
+    size_t allocated;
+} TokenBuffer;
 
-char * Exp_prepare(Exp *exp)
+typedef struct LexToken
 {
-    if (exp->tag == exp_call)
-    {
-        struct exp_call call =  exp->exp_call;
-        if (strcmp(call.callee, "toString") == 0)
-        {
-            char *varName = call.args[0]->exp_var.name;
-            char *finalVar = malloc(sizeof(char) * 3);
-            char *mod = finalVar;
-            *mod = var;
-            mod++;
-            *mod = '1';
-            mod++;
-            *mod = '\0';
+    int16_t kind;
+    uint32_t offset;
+    uint32_t length;
+    int32_t value;
+    uint32_t line;
+    uint32_t column;
+} LexToken;
+
+// The decoded bytes of a string literal, which may include NULs. bytes
+// points into Source when the text needed no decoding.
+typedef struct StringLiteral
+{
+    const char *bytes;
+    size_t length;
+    bool owned;
+} StringLiteral;
 
-            printPad("%%%s =l call $itos(w %%%s)\n", finalVar, varName);
+// Everything one compilation reads and writes. Funcoc_compile points Ctx
+// at it on the calling thread and on each thread it starts. State whose
+// type is defined further down is allocated separately by Funcoc_new.
+struct Funcoc
+{
+    struct FuncocOptions options;
+
+    FuncocSink sink;
+    void *sinkUser;
+    FILE *out;          // writes to the sink
+    FILE *CodeOut;      // where lowered functions go: out, or a buffer under --pipeline
+
+    // the first error wins when several threads fail at once
+    char error[512];
+    atomic_bool failed;
+    pthread_mutex_t errorLock;
+
+    const char *name;
+    const char *Source;
+    size_t SourceLen;
+    struct TokenBuffer Tokens;
+    struct TokenRing *tokenRing;
+    bool lexerStarted;
+    bool codegenStarted;
+
+    struct LexToken CurToken;   // the token the parser is looking at
+    int CurTok;
+    long CurIdx;
+    char *IdentifierStr;
+    int NumVal;
+    int Depth;
+    int nesting;                // ParseExpression calls in progress
+    // operands and pending operators of the expressions being parsed;
+    // a nested ParseExpression works above its caller's entries
+    uint32_t *operands;         // ExpIds
+    size_t numOperands;
+    size_t operandsAllocated;
+    char *operators;
+    size_t numOperators;
+    size_t operatorsAllocated;
+    struct VarRefMap varMap;
+    struct StringLiteral *stringLiterals;
+    int curLit;
+    size_t literalsAllocated;
+    pthread_mutex_t literalsLock;
+    struct Ast *Tree;
+    uint32_t *Expressions;      // ExpIds of the top level functions
+    int ExpCount;
+    size_t ExpAllocated;
+    struct BatchQueue *batchQueue;
+
+    struct Signatures *signatures;
+    long CurSignature;          // of the function being parsed, -1 outside
+
+    struct IlFunction *CurFn;   // the function codegen is emitting into
+    const char *CurFnName;      // its source name, for spotting self calls
+    uint32_t inlining;          // ExpId of the function inlined into it
+    char **inlineArgs;          // operands bound to its parameters, or NULL
+    struct Interfaces *interfaces;
+    struct Profile *profile;
+    struct ProfiledFunctions *profiled;
+    struct CallGraph *callGraph;
+    struct RuntimeModules *emittedRuntime;
+    long *emitCounts;
+
+    // AST counts add up over the context's compilations for --stats,
+    // the IL ones are reported and cleared after each
+    size_t *ExpTagCounts;
+    size_t astNodes;
+    size_t astBytes;
+    size_t *PeepholeHits;
+    struct IlStats *ilStats;
+};
 
-            return finalVar;
-        }
-    } else if(exp->tag == exp_var)
-    {
-        char *varName = exp->exp_var.name;
-        int len = strlen(varName) + 1;
-        char *finalVar = malloc(sizeof(char) * len);
-        strlcpy(finalVar, varName, len);
-        return finalVar;
-    }
-    return NULL;
-}
+static _Thread_local struct Funcoc *Ctx = NULL;
+
+// where compileError unwinds to on this thread, NULL outside a compilation
+static _Thread_local jmp_buf *ErrorJump = NULL;
 
-char *Exp_getType(Exp *exp)
+// Fails the compilation with a message. Outside of one, as when the
+// command line is read, the message is printed and the process exits.
+static _Noreturn void compileError(const char *fmt, ...)
 {
-    if (exp->tag == exp_declaration)
+    va_list args;
+    va_start(args, fmt);
+    if (ErrorJump == NULL)
     {
-        return exp->exp_declaration.type;
+        vprintf(fmt, args);
+        exit(-1);
     }
-    if (exp->tag == exp_var)
+
+    pthread_mutex_lock(&Ctx->errorLock);
+    if (!atomic_load(&Ctx->failed))
     {
-        char *type = VarRefMap_getValue(&varMap, exp->exp_var.name);
-        if (type == NULL)
-        {
-            printf("type not found");
-            exit(-1);
-        }
-        return type;
+        vsnprintf(Ctx->error, sizeof(Ctx->error), fmt, args);
+        atomic_store(&Ctx->failed, true);
     }
-    printf("type not found");
-    exit(-1);
+    pthread_mutex_unlock(&Ctx->errorLock);
+    va_end(args);
+    longjmp(*ErrorJump, 1);
 }
 
-char *getQbeType(char *type)
+// unwinds this thread once another one has failed the compilation
+static void checkFailed()
 {
-    if (strcmp(type, "int") == 0)
+    if (atomic_load_explicit(&Ctx->failed, memory_order_relaxed))
     {
-        return "w";
-    } else if (strcmp(type, "string") == 0)
-    {
-        return "l";
-    } else
-    {
-        printf("type not implemented");
-        exit(-1);
+        longjmp(*ErrorJump, 1);
     }
 }
 
-void Exp_getLeftAssignment(Exp *exp)
+// inputs smaller than this per thread are lexed on the calling thread
+#define LEX_CHUNK_MIN (1 << 20)
+#define LEX_MAX_THREADS 16
+
+static void TokenBuffer_reserve(struct TokenBuffer *buf, size_t size)
+{
+    // the columns share one capacity
+    size_t allocated = buf->allocated;
+    VEC_RESERVE(buf->kind, allocated, size);
+    allocated = buf->allocated;
+    VEC_RESERVE(buf->offset, allocated, size);
+    allocated = buf->allocated;
+    VEC_RESERVE(buf->length, allocated, size);
+    allocated = buf->allocated;
+    VEC_RESERVE(buf->value, allocated, size);
+    allocated = buf->allocated;
+    VEC_RESERVE(buf->line, allocated, size);
+    allocated = buf->allocated;
+    VEC_RESERVE(buf->column, allocated, size);
+    buf->allocated = allocated;
+}
+
+static void TokenBuffer_push(struct TokenBuffer *buf, int kind, size_t offset, size_t length, int value, uint32_t line, uint32_t column)
 {
-    if (exp->tag == exp_declaration)
-    {
-        struct exp_declaration decl = exp->exp_declaration;
-        printPad("%%%s", decl.name);
-        return;
-    }
-    if (exp->tag == exp_var)
+    if (buf->size == buf->allocated)
     {
-        printPad("%%%s", exp->exp_var.name);
-        return;
+        TokenBuffer_reserve(buf, buf->size + 1);
     }
+    buf->kind[buf->size] = kind;
+    buf->offset[buf->size] = offset;
+    buf->length[buf->size] = length;
+    buf->value[buf->size] = value;
+    buf->line[buf->size] = line;
+    buf->column[buf->size] = column;
+    buf->size++;
+}
 
-    printf("cannot assign");
-    exit(-1);
+static void TokenBuffer_free(struct TokenBuffer *buf)
+{
+    free(buf->kind);
+    free(buf->offset);
+    free(buf->length);
+    free(buf->value);
+    free(buf->line);
+    free(buf->column);
+    *buf = (struct TokenBuffer) { .size = 0, .allocated = 0 };
 }
 
+static bool isKeyword(const char *src, size_t len, const char *keyword)
+{
+    return strlen(keyword) == len && strncmp(src, keyword, len) == 0;
+}
 
-void Exp_toIL(Exp *exp)
+// Lexes src[begin, end) into buf, numbering lines from line, and returns
+// the line number at end. No token spans a newline, so any range that
+// starts at a line start can be lexed independently of the others.
+static uint32_t lexRange(const char *src, size_t begin, size_t end, uint32_t line, struct TokenBuffer *buf)
 {
-    if (exp->tag == exp_function)
+    size_t pos = begin;
+    size_t lineStart = begin;
+    while (true)
     {
-        char *funcName = exp->exp_function.proto->name;
-
-        if (strcmp(funcName, "entry") == 0)
+        while (pos < end && isspace((unsigned char)src[pos]))
         {
-            printf("export function w $main() {");
-            printf("\n");
-        } else {
-            printf("function $%s() {", funcName);
-            printf("\n");
+            if (src[pos] == '\n')
+            {
+                line++;
+                lineStart = pos + 1;
+            }
+            pos++;
         }
 
-        printPad("@start\n");
-
-        Depth++;
-
-        exp_body *body = exp->exp_function.body;
-
-        int numExprs = body->numExprs;
-
-        for (int i = 0; i < numExprs; i++)
+        if (pos >= end)
         {
-            Exp_toIL(body->exprs[i]);
+            return line;
         }
-        printPad("ret 0\n");
-        Depth--;
-        printPad("}\n");
-    }
 
-    if (exp->tag == exp_assignment)
-    {
-        Context = assignment;
-        struct exp_assignment asign = exp->exp_assignment;
+        size_t start = pos;
+        uint32_t column = start - lineStart + 1;
+        unsigned char c = src[pos];
 
-        Exp_getLeftAssignment(asign.target);
-
-        char *type = Exp_getType(asign.target);
-        char *qbeType = getQbeType(type);
-        printf(" =%s ", qbeType);
-
-        Exp_toIL(asign.right);
-        Context = none;
-    }
-
-    if (exp->tag == exp_call)
-    {
-        Context = reference;
-        struct exp_call call = exp->exp_call;
-        if (strcmp(call.callee, "print") == 0)
+        if (c == '"')
         {
-            char **vars = malloc(sizeof(char *) * 1);
-            size_t allocated = 1;
-            size_t size = 0;
-            for (int i = 0; i < call.numArgs; i++)
+            // escapes are only skipped here and decoded by the parser
+            bool escapes = false;
+            pos++;
+            while (pos < end && src[pos] != '"' && src[pos] != '\n')
             {
-                char * finalVar = Exp_prepare(call.args[i]);
-                if (allocated < size + 1)
+                if (src[pos] == '\\' && pos + 1 < end && src[pos + 1] != '\n')
                 {
-                    char **temp = realloc(vars, allocated + 1);
-                    if (temp == NULL)
-                    {
-                        printf("error allocating memory");
-                        exit(-1);
-                    }
-                    allocated++;
-                    vars = temp;
+                    escapes = true;
+                    pos++;
                 }
-                vars[size++] = finalVar;
+                pos++;
+            }
+            if (pos >= end || src[pos] != '"')
+            {
+                compileError("expected \"");
             }
+            TokenBuffer_push(buf, tok_quo, start + 1, pos - start - 1, escapes, line, column);
+            pos++; // eat "
+            continue;
+        }
+
+        // \\ starts a line of a raw literal, taken as is up to the newline
+        if (c == '\\' && pos + 1 < end && src[pos + 1] == '\\')
+        {
+            pos += 2;
+            size_t textStart = pos;
+            const char *newline = memchr(src + pos, '\n', end - pos);
+            pos = newline == NULL ? end : (size_t)(newline - src);
+            size_t textEnd = pos > textStart && src[pos - 1] == '\r' ? pos - 1 : pos;
+            TokenBuffer_push(buf, tok_rawline, textStart, textEnd - textStart, 0, line, column);
+            continue;
+        }
 
-            bool first = true;
-            for (int i = 0; i < size; i++)
+        if (c == '=')
+        {
+            pos++;
+            if (pos < end && src[pos] == '=')
             {
-                printPad("call $dputs(l %%%s, w 1)\n", vars[i]);
-                free(vars[i]);
+                pos++;
+                TokenBuffer_push(buf, tok_equals, start, 2, 0, line, column);
+                continue;
             }
-            free(vars);
+            TokenBuffer_push(buf, tok_assignment, start, 1, 0, line, column);
+            continue;
         }
-        Context = none;
-    }
 
-    if (exp->tag == exp_var)
-    {
-        char *vartype = VarRefMap_getValue(&varMap, exp->exp_var.name);
-        char *qbetype = getQbeType(vartype);
+        if ((c == '!' || c == '<' || c == '>') && pos + 1 < end && src[pos + 1] == '=')
+        {
+            pos += 2;
+            TokenBuffer_push(buf, c == '!' ? tok_notEquals : c == '<' ? tok_lessEquals : tok_greaterEquals, start, 2, 0, line, column);
+            continue;
+        }
 
-        printf("%s %%%s", qbetype, exp->exp_var.name);
-    }
+        if (isalpha(c))
+        {
+            while (pos < end && isalnum((unsigned char)src[pos]))
+            {
+                pos++;
+            }
+            size_t len = pos - start;
 
-    if (exp->tag == exp_add)
-    {
-        // assume add expression is int expression;
-        int val1 = exp->exp_add.left->exp_int.val;
-        int val2 = exp->exp_add.right->exp_int.val;
-        printf("add %d, %d\n", val1, val2);
-    }
+            if (pos < end && src[pos] == ':')
+            {
+                pos++; // eat :
+                TokenBuffer_push(buf, tok_declaration, start, len, 0, line, column);
+                continue;
+            }
 
-    if (exp->tag == exp_stringlit)
-    {
-        if (Context == assignment)
+            int kind = tok_identifier;
+            if (isKeyword(src + start, len, "fn"))
+            {
+                kind = tok_fn;
+            } else if (isKeyword(src + start, len, "expose"))
+            {
+                kind = tok_expose;
+            } else if (isKeyword(src + start, len, "return"))
+            {
+                kind = tok_return;
+            } else if (isKeyword(src + start, len, "if"))
+            {
+                kind = tok_if;
+            } else if (isKeyword(src + start, len, "else"))
+            {
+                kind = tok_else;
+            } else if (isKeyword(src + start, len, "likely"))
+            {
+                kind = tok_likely;
+            } else if (isKeyword(src + start, len, "unlikely"))
+            {
+                kind = tok_unlikely;
+            }
+            TokenBuffer_push(buf, kind, start, len, 0, line, column);
+            continue;
+        }
+
+        if (isdigit(c))
         {
-            printf("copy ");
+            long value = 0;
+            while (pos < end && isdigit((unsigned char)src[pos]))
+            {
+                value = value * 10 + (src[pos] - '0');
+                if (value > INT_MAX)
+                {
+                    compileError("integer literal too large");
+                }
+                pos++;
+            }
+            TokenBuffer_push(buf, tok_int, start, pos - start, (int)value, line, column);
+            continue;
         }
-        struct exp_stringlit expLit = exp->exp_stringlit;
-        printf("$sl%d\n", expLit.literalId);
+
+        pos++;
+        TokenBuffer_push(buf, c, start, 1, 0, line, column);
     }
 }
 
-void Exp_print(Exp *exp)
+typedef struct LexChunk
+{
+    size_t begin;
+    size_t end;
+    uint32_t lines;     // newlines in [begin, end)
+    struct TokenBuffer tokens;
+    struct Funcoc *ctx;
+    pthread_t thread;
+} LexChunk;
+
+static void *LexChunk_run(void *arg)
 {
-    if (!exp)
+    struct LexChunk *chunk = arg;
+    jmp_buf onError;
+    Ctx = chunk->ctx;
+    ErrorJump = &onError;
+    if (setjmp(onError) != 0)
     {
-        return;
+        return NULL;
     }
+    // a rough tokens-per-byte guess saves most of the regrowth
+    TokenBuffer_reserve(&chunk->tokens, (chunk->end - chunk->begin) / 4 + 1);
+    chunk->lines = lexRange(Ctx->Source, chunk->begin, chunk->end, 0, &chunk->tokens);
+    return NULL;
+}
 
-    if(exp == NULL)
+static int lexThreadCount()
+{
+    long threads = Ctx->options.lexThreads;
+    if (threads <= 0)
     {
-        return;
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
     }
 
-    if (exp->tag == exp_function)
+    long bySize = Ctx->SourceLen / LEX_CHUNK_MIN;
+    if (Ctx->options.lexThreads <= 0 && threads > bySize)
     {
-        struct exp_prototype proto = *exp->exp_function.proto;
-        Exp_printPrototype(&proto);
-        printf(" {\n");
-        exp_body *body = exp->exp_function.body;
-        for (int i = 0; i < body->numExprs; i++)
-        {
-            printf("    ");
-            Exp_print(body->exprs[i]);
-            printf(";\n");
-        }
-        printf("}\n");
-        return;
+        threads = bySize;
     }
-    
-    if (exp->tag == exp_prototype)
+    if (threads > LEX_MAX_THREADS)
     {
-        struct exp_prototype proto = exp->exp_prototype;
-        Exp_printPrototype(&proto);
-        return;
+        threads = LEX_MAX_THREADS;
     }
+    return threads < 1 ? 1 : threads;
+}
 
-    if (exp->tag == exp_declaration)
+// Fills Tokens for all of Source. Large inputs are cut into one chunk per
+// thread at the line start following each even split point, lexed
+// concurrently and concatenated in order.
+static void lexSource()
+{
+    if (Ctx->SourceLen > UINT32_MAX)
     {
-        printf("%s: %s", exp->exp_declaration.name, exp->exp_declaration.type);
-        return;
+        compileError("source file too large");
     }
 
-    if (exp->tag == exp_assignment)
+    int threads = lexThreadCount();
+    if (threads == 1)
     {
-        Exp_print(exp->exp_assignment.target);
-        printf("=");
-        Exp_print(exp->exp_assignment.right);
+        TokenBuffer_reserve(&Ctx->Tokens, Ctx->SourceLen / 4 + 1);
+        uint32_t line = lexRange(Ctx->Source, 0, Ctx->SourceLen, 1, &Ctx->Tokens);
+        TokenBuffer_push(&Ctx->Tokens, tok_eof, Ctx->SourceLen, 0, 0, line, 1);
         return;
     }
 
-    if (exp->tag == exp_int)
+    struct LexChunk chunks[LEX_MAX_THREADS];
+    bool started = true;
+    size_t begin = 0;
+    for (int i = 0; i < threads; i++)
     {
-        printf("%d", exp->exp_int.val);
-        return;
+        size_t end = Ctx->SourceLen * (i + 1) / threads;
+        while (end < Ctx->SourceLen && Ctx->Source[end - 1] != '\n')
+        {
+            end++;
+        }
+        if (end < begin)
+        {
+            end = begin;
+        }
+
+        chunks[i] = (struct LexChunk) { .begin = begin, .end = end, .tokens = { .size = 0, .allocated = 0 }, .ctx = Ctx };
+        if (pthread_create(&chunks[i].thread, NULL, LexChunk_run, &chunks[i]) != 0)
+        {
+            // the chunks already running are joined before failing
+            threads = i;
+            started = false;
+            break;
+        }
+        begin = end;
     }
 
-    if (exp->tag == exp_var)
+    size_t total = 1;
+    for (int i = 0; i < threads; i++)
     {
-        printf("%s", exp->exp_var.name);
-        return;
+        pthread_join(chunks[i].thread, NULL);
+        total += chunks[i].tokens.size;
     }
-
-    if (exp->tag == exp_add)
+    if (!started || atomic_load(&Ctx->failed))
     {
-        Exp_print(exp->exp_add.left);
-        printf("+");
-        Exp_print(exp->exp_add.right);
-        return;
+        for (int i = 0; i < threads; i++)
+        {
+            TokenBuffer_free(&chunks[i].tokens);
+        }
+        if (!started)
+        {
+            compileError("could not start lexer thread");
+        }
+        checkFailed();
     }
 
-    if (exp->tag == exp_call)
+    // chunks number their lines from 0, rebased here once the earlier
+    // chunks' line counts are known
+    TokenBuffer_reserve(&Ctx->Tokens, total);
+    uint32_t line = 1;
+    for (int i = 0; i < threads; i++)
     {
-        printf("%s(", exp->exp_call.callee);
-        int numArgs = exp->exp_call.numArgs;
-        Exp **args = exp->exp_call.args;
-        bool first = true;
-        for (int i = 0; i < numArgs; i++)
+        struct TokenBuffer *part = &chunks[i].tokens;
+        memcpy(Ctx->Tokens.kind + Ctx->Tokens.size, part->kind, sizeof(int16_t) * part->size);
+        memcpy(Ctx->Tokens.offset + Ctx->Tokens.size, part->offset, sizeof(uint32_t) * part->size);
+        memcpy(Ctx->Tokens.length + Ctx->Tokens.size, part->length, sizeof(uint32_t) * part->size);
+        memcpy(Ctx->Tokens.value + Ctx->Tokens.size, part->value, sizeof(int32_t) * part->size);
+        memcpy(Ctx->Tokens.column + Ctx->Tokens.size, part->column, sizeof(uint32_t) * part->size);
+        for (size_t j = 0; j < part->size; j++)
         {
-            if (first)
-            {
-                first = false;
-                Exp_print(args[i]);
-                continue;
-            }
-            printf(",");
-            Exp_print(args[i]);
+            Ctx->Tokens.line[Ctx->Tokens.size + j] = part->line[j] + line;
         }
-        printf(")");
-        return;
+        Ctx->Tokens.size += part->size;
+        line += chunks[i].lines;
+        TokenBuffer_free(part);
     }
+    TokenBuffer_push(&Ctx->Tokens, tok_eof, Ctx->SourceLen, 0, 0, line, 1);
 }
 
-static int CurTok;
-
-static int getNextToken()
+static char *tokenText(uint32_t offset, uint32_t len)
 {
-    return CurTok = gettok(fptr);
+    char *text = malloc(sizeof(char) * (len + 1));
+    if (text == NULL)
+    {
+        compileError("error allocating memory");
+    }
+    memcpy(text, Ctx->Source + offset, len);
+    text[len] = '\0';
+    return text;
 }
 
-#define EXP_NEW(tag, ...) \
-    Exp_new((Exp){tag, {.tag=(struct tag){__VA_ARGS__}}})
-
-typedef struct TokPrecedenceArray
-{
-    struct TokPrecedenceMap *map;
-    size_t size;
-} TokPrecedenceArray;
 
-typedef struct TokPrecedenceMap
-{
-    char Key;
-    int Val;
-} TokPrecedenceMap;
+// --pipeline runs the lexer on its own thread, feeding the parser through
+// a single-producer single-consumer ring. Each side keeps a private copy
+// of the other's index and only rereads the shared one when the ring looks
+// full or empty; the lexer publishes once per block of source.
+#define TOKEN_RING_SIZE 8192
+#define LEX_BLOCK (64 << 10)
 
-static struct TokPrecedenceArray BinopPrecedenceArr =
+typedef struct TokenRing
 {
-    .size = 4,
-    .map = (struct TokPrecedenceMap[])
-    {
-        [0] = { .Key = '<', .Val = 10 },
-        [1] = { .Key = '+', .Val = 20 },
-        [2] = { .Key = '-', .Val = 20 },
-        [3] = { .Key = '*', .Val = 40 }
-    }
-};
-
-static int getValue(struct TokPrecedenceArray arr, char key)
+    struct LexToken items[TOKEN_RING_SIZE];
+    _Atomic size_t head;    // next slot the lexer fills
+    _Atomic size_t tail;    // next slot the parser reads
+    size_t producerHead;
+    size_t producerTail;
+    size_t consumerHead;
+    struct TokenBuffer block;   // the lexer's scratch buffer
+    struct Funcoc *ctx;
+    pthread_t thread;
+} TokenRing;
+
+static void TokenRing_push(struct TokenRing *ring, struct LexToken tok)
 {
-    for (int i = 0; i < arr.size; i++)
+    while (ring->producerHead - ring->producerTail == TOKEN_RING_SIZE)
     {
-        struct TokPrecedenceMap chk = arr.map[i];
-        if (chk.Key == key)
+        atomic_store_explicit(&ring->head, ring->producerHead, memory_order_release);
+        ring->producerTail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (ring->producerHead - ring->producerTail == TOKEN_RING_SIZE)
         {
-            return chk.Val;
+            // the parser may have stopped for good
+            checkFailed();
+            sched_yield();
         }
     }
+    ring->items[ring->producerHead % TOKEN_RING_SIZE] = tok;
+    ring->producerHead++;
+}
 
-    return -1;
+static void TokenRing_publish(struct TokenRing *ring)
+{
+    atomic_store_explicit(&ring->head, ring->producerHead, memory_order_release);
 }
 
-static int GetTokPrecedence()
+// Waits until the n-th unread token (from 0) has been published
+static struct LexToken *TokenRing_peek(struct TokenRing *ring, size_t n)
 {
-    if (CurTok > 127) // is not ascii
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (ring->consumerHead - tail <= n)
     {
-        return -1;
+        ring->consumerHead = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (ring->consumerHead - tail <= n)
+        {
+            checkFailed();
+            sched_yield();
+        }
     }
-
-    int TokPrec = getValue(BinopPrecedenceArr, CurTok);
-    if (TokPrec <= 0) return -1;
-    return TokPrec;
+    return &ring->items[(tail + n) % TOKEN_RING_SIZE];
 }
 
-static Exp *ParsePrimary();
-
-static Exp *ParseStringLiteral()
+static struct LexToken TokenRing_pop(struct TokenRing *ring)
 {
-    char next = nextChar(); // eat "
+    struct LexToken tok = *TokenRing_peek(ring, 0);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return tok;
+}
 
-    char *str = malloc(sizeof(char) * 1);
-    *str = '\0';
+static void *TokenRing_lex(void *arg)
+{
+    struct TokenRing *ring = arg;
+    struct TokenBuffer *block = &ring->block;
+    jmp_buf onError;
+    Ctx = ring->ctx;
+    ErrorJump = &onError;
+    if (setjmp(onError) != 0)
+    {
+        return NULL;
+    }
 
-    while (true)
+    size_t begin = 0;
+    uint32_t line = 1;
+    while (begin < Ctx->SourceLen)
     {
-        char *temp = appendStringAlloc(str, next);
-        if (temp == NULL)
-        {
-            printf("error allocating memory");
-            exit(-1);
-        }
-        free(str);
-        str = temp;
-        next = nextChar();
-        if (next == '"')
+        size_t end = begin + LEX_BLOCK < Ctx->SourceLen ? begin + LEX_BLOCK : Ctx->SourceLen;
+        while (end < Ctx->SourceLen && Ctx->Source[end - 1] != '\n')
         {
-            break;
-        }
-        if (next == '\n')
-        {
-            break;
+            end++;
         }
-    }
-    if (next == '\n')
-    {
-        printf("expected """);
-        exit(-1);
-    }
-    nextChar(); // eat "
 
-    if (curLit == 0)
-    {
-        char **tempAr = malloc(sizeof(char *) * 8);
-        if (tempAr == NULL)
+        checkFailed();
+        block->size = 0;
+        line = lexRange(Ctx->Source, begin, end, line, block);
+        for (size_t i = 0; i < block->size; i++)
         {
-            printf("error allocating memory");
-            exit(-1);
+            TokenRing_push(ring, (struct LexToken) { block->kind[i], block->offset[i], block->length[i], block->value[i], block->line[i], block->column[i] });
         }
-        stringLiterals = tempAr;
+        TokenRing_publish(ring);
+        begin = end;
     }
 
-    char **set = stringLiterals + curLit;
-    *set = str;
-    getNextToken(); // hopefully parse symbol ;
-
-    Exp *exp = EXP_NEW(exp_stringlit, curLit);
-    curLit++;
-    return exp;
+    TokenRing_push(ring, (struct LexToken) { .kind = tok_eof, .offset = Ctx->SourceLen, .line = line, .column = 1 });
+    TokenRing_publish(ring);
+    TokenBuffer_free(block);
+    return NULL;
 }
 
-static Exp *ParseBinOpRHS(int exprPrec, Exp *lhs)
+static void TokenRing_start(struct TokenRing *ring)
 {
-    while (1)
+    if (Ctx->SourceLen > UINT32_MAX)
     {
-        int TokPrec = GetTokPrecedence();
-        if (TokPrec < exprPrec)
-        {
-            return lhs;
-        }
+        compileError("source file too large");
+    }
 
-        int BinOp = CurTok;
-        if (BinOp != '+')
-        {
-            printf("not implemented");
-            free(lhs);
-            exit(-1);
-        }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->producerHead = 0;
+    ring->producerTail = 0;
+    ring->consumerHead = 0;
+    ring->ctx = Ctx;
+    if (pthread_create(&ring->thread, NULL, TokenRing_lex, ring) != 0)
+    {
+        compileError("could not start lexer thread");
+    }
+    Ctx->lexerStarted = true;
+}
 
-        getNextToken(); // eat binop
+// The AST lives in one set of flat arrays instead of a heap block per
+// node. A node is an ExpId: its tag and the slot in the array for its kind.
+// Children are ExpIds, and variable length child lists (call arguments,
+// function bodies) are ranges of the shared lists array, so a whole
+// function body is contiguous and passes walk it front to back.
+typedef uint32_t ExpId;
+
+#define EXP_NONE UINT32_MAX
+
+typedef struct SourceLoc { uint32_t line; uint32_t column; } SourceLoc;
+
+enum EXP {
+    exp_int,
+    exp_var,
+    exp_add,
+    exp_call,
+    exp_function,
+    exp_assignment,
+    exp_declaration,
+    exp_stringlit,
+    exp_index,
+    exp_return,
+    exp_compare,
+    exp_if
+};
 
-        Exp *rhs = ParsePrimary();
+// type is resolved against the declarations parsed so far, NULL if none
+typedef struct ExpVar { char *name; char *type; } ExpVar;
+typedef struct ExpAdd { ExpId left; ExpId right; } ExpAdd;
+// type is the callee's return type, resolved like ExpVar's, NULL if none
+typedef struct ExpCall { char *callee; uint32_t args; uint32_t numArgs; char *type; } ExpCall;
+// param and return types are the static strings from valueType
+typedef struct ExpParam { char *name; char *type; } ExpParam;
+typedef struct ExpFunction { char *name; uint32_t params; uint32_t numParams; uint32_t body; uint32_t numExprs; bool exposed; char *retType; } ExpFunction;
+typedef struct ExpAssignment { ExpId target; ExpId right; } ExpAssignment;
+typedef struct ExpDeclaration { char *type; char *name; } ExpDeclaration;
+typedef struct ExpIndex { ExpId array; ExpId index; } ExpIndex;
+// op is the token: '<', '>', tok_equals, tok_notEquals, ...
+typedef struct ExpCompare { int op; ExpId left; ExpId right; } ExpCompare;
+// hint is 1 for likely, -1 for unlikely; numOtherwise is 0 without else
+typedef struct ExpIf { ExpId cond; uint32_t then; uint32_t numThen; uint32_t otherwise; uint32_t numOtherwise; int hint; } ExpIf;
+
+#define AST_ARRAY(type) struct { type *items; size_t size; size_t allocated; }
+
+typedef struct Ast
+{
+    uint8_t *tags;      // indexed by ExpId
+    uint32_t *slots;    // indexed by ExpId, position in the array for the tag
+    struct SourceLoc *locs;     // indexed by ExpId
+    size_t size;
+    size_t tagsAllocated;
+    size_t slotsAllocated;
+    size_t locsAllocated;
+
+    AST_ARRAY(int) ints;
+    AST_ARRAY(struct ExpVar) vars;
+    AST_ARRAY(struct ExpAdd) adds;
+    AST_ARRAY(struct ExpCall) calls;
+    AST_ARRAY(struct ExpFunction) functions;
+    AST_ARRAY(struct ExpAssignment) assignments;
+    AST_ARRAY(struct ExpDeclaration) declarations;
+    AST_ARRAY(int) stringlits;
+    AST_ARRAY(struct ExpIndex) indexes;
+    AST_ARRAY(ExpId) returns;   // the value, EXP_NONE for a bare return
+    AST_ARRAY(struct ExpCompare) compares;
+    AST_ARRAY(struct ExpIf) ifs;
+
+    AST_ARRAY(ExpId) lists;
+    AST_ARRAY(struct ExpParam) params;
+} Ast;
+
+// the tree being built or lowered by the current thread, see --pipeline
+static _Thread_local struct Ast *Nodes = NULL;
+
+static const char *ExpTagNames[] =
+{
+    [exp_int] = "exp_int",
+    [exp_var] = "exp_var",
+    [exp_add] = "exp_add",
+    [exp_call] = "exp_call",
+    [exp_function] = "exp_function",
+    [exp_assignment] = "exp_assignment",
+    [exp_declaration] = "exp_declaration",
+    [exp_stringlit] = "exp_stringlit",
+    [exp_index] = "exp_index",
+    [exp_return] = "exp_return",
+    [exp_compare] = "exp_compare",
+    [exp_if] = "exp_if"
+};
 
-        if (rhs == NULL)
-        {
-            free(lhs);
-            return NULL;
-        }
+#define NUM_EXP_TAGS (sizeof(ExpTagNames) / sizeof(ExpTagNames[0]))
+
+#define EXP_TAG(id) ((enum EXP)Nodes->tags[(id)])
+#define EXP_LOC(id) (Nodes->locs[(id)])
+#define EXP_INT(id) (Nodes->ints.items[Nodes->slots[(id)]])
+#define EXP_VAR(id) (&Nodes->vars.items[Nodes->slots[(id)]])
+#define EXP_ADD(id) (&Nodes->adds.items[Nodes->slots[(id)]])
+#define EXP_CALL(id) (&Nodes->calls.items[Nodes->slots[(id)]])
+#define EXP_FUNCTION(id) (&Nodes->functions.items[Nodes->slots[(id)]])
+#define EXP_ASSIGNMENT(id) (&Nodes->assignments.items[Nodes->slots[(id)]])
+#define EXP_DECLARATION(id) (&Nodes->declarations.items[Nodes->slots[(id)]])
+#define EXP_STRINGLIT(id) (Nodes->stringlits.items[Nodes->slots[(id)]])
+#define EXP_INDEX(id) (&Nodes->indexes.items[Nodes->slots[(id)]])
+#define EXP_RETURN(id) (Nodes->returns.items[Nodes->slots[(id)]])
+#define EXP_COMPARE(id) (&Nodes->compares.items[Nodes->slots[(id)]])
+#define EXP_IF(id) (&Nodes->ifs.items[Nodes->slots[(id)]])
+
+// i-th entry of a child range
+#define EXP_CHILD(range, i) (Nodes->lists.items[(range) + (i)])
+
+#define AST_PUSH(array, item) \
+    VEC_PUSH(Nodes->array.items, Nodes->array.size, Nodes->array.allocated, item)
+
+static struct SourceLoc CurLoc()
+{
+    return (struct SourceLoc) { Ctx->CurToken.line, Ctx->CurToken.column };
+}
 
-        int nextPrec = GetTokPrecedence();
-        if (TokPrec < nextPrec)
-        {
-            Exp *temp = ParseBinOpRHS(TokPrec + 1, rhs);
-            if (temp == NULL)
-            {
-                return NULL;
-            }
-            rhs = temp;
-        }
+// Appends a node whose contents are the last entry of its kind's array.
+// It is located at the current token; the parser moves nodes built after
+// their first token back to where they start.
+static ExpId Exp_new(enum EXP tag, size_t slot)
+{
+    Ctx->ExpTagCounts[tag]++;
+    VEC_RESERVE(Nodes->tags, Nodes->tagsAllocated, Nodes->size + 1);
+    VEC_RESERVE(Nodes->slots, Nodes->slotsAllocated, Nodes->size + 1);
+    VEC_RESERVE(Nodes->locs, Nodes->locsAllocated, Nodes->size + 1);
+    Nodes->tags[Nodes->size] = tag;
+    Nodes->slots[Nodes->size] = slot;
+    Nodes->locs[Nodes->size] = CurLoc();
+    return Nodes->size++;
+}
 
-        Exp *addExpr = EXP_NEW(exp_add, lhs, rhs);
+static ExpId Exp_newInt(int val)
+{
+    AST_PUSH(ints, val);
+    return Exp_new(exp_int, Nodes->ints.size - 1);
+}
 
-        return addExpr;
-    }
+static ExpId Exp_newVar(char *name)
+{
+    AST_PUSH(vars, ((struct ExpVar) { .name = name, .type = VarRefMap_getValue(&Ctx->varMap, name) }));
+    return Exp_new(exp_var, Nodes->vars.size - 1);
 }
 
-static Exp *ParseIntExpr()
+static ExpId Exp_newAdd(ExpId left, ExpId right)
 {
-    Exp *exp = EXP_NEW(exp_int, NumVal);
-    getNextToken();
-    return exp;
+    AST_PUSH(adds, ((struct ExpAdd) { .left = left, .right = right }));
+    return Exp_new(exp_add, Nodes->adds.size - 1);
 }
 
+static ExpId Exp_newCall(char *callee, uint32_t args, uint32_t numArgs, char *type)
+{
+    AST_PUSH(calls, ((struct ExpCall) { .callee = callee, .args = args, .numArgs = numArgs, .type = type }));
+    return Exp_new(exp_call, Nodes->calls.size - 1);
+}
 
-static Exp *ParseExpression()
+static ExpId Exp_newFunction(struct ExpFunction fn)
 {
-    Exp *lhs = ParsePrimary();
-    if (!lhs)
-    {
-        return NULL;
-    }
+    AST_PUSH(functions, fn);
+    return Exp_new(exp_function, Nodes->functions.size - 1);
+}
 
-    Exp* exp = ParseBinOpRHS(0, lhs);
-    return exp;
+static ExpId Exp_newAssignment(ExpId target, ExpId right)
+{
+    AST_PUSH(assignments, ((struct ExpAssignment) { .target = target, .right = right }));
+    return Exp_new(exp_assignment, Nodes->assignments.size - 1);
 }
 
-static Exp *ParseDeclaration()
+static ExpId Exp_newDeclaration(char *type, char *name)
 {
-    char *varName = IdentifierStr;
+    AST_PUSH(declarations, ((struct ExpDeclaration) { .type = type, .name = name }));
+    return Exp_new(exp_declaration, Nodes->declarations.size - 1);
+}
 
-    getNextToken(); // eat type
+static ExpId Exp_newStringlit(int literalId)
+{
+    AST_PUSH(stringlits, literalId);
+    return Exp_new(exp_stringlit, Nodes->stringlits.size - 1);
+}
 
-    char *type = IdentifierStr;
+static ExpId Exp_newIndex(ExpId array, ExpId index)
+{
+    AST_PUSH(indexes, ((struct ExpIndex) { .array = array, .index = index }));
+    return Exp_new(exp_index, Nodes->indexes.size - 1);
+}
 
-    struct VarRefKeyValue *temp = calloc(1, sizeof(struct VarRefKeyValue));
-    if (temp == NULL)
-    {
-        printf("error allocating memory");
-        exit(-1);
-    }
+static ExpId Exp_newReturn(ExpId value)
+{
+    AST_PUSH(returns, value);
+    return Exp_new(exp_return, Nodes->returns.size - 1);
+}
 
-    struct VarRefKeyValue keyval = (struct VarRefKeyValue) { .Key = varName, .Val = type };
-    VarRefMap_add(&varMap, keyval);
+static ExpId Exp_newCompare(int op, ExpId left, ExpId right)
+{
+    AST_PUSH(compares, ((struct ExpCompare) { .op = op, .left = left, .right = right }));
+    return Exp_new(exp_compare, Nodes->compares.size - 1);
+}
 
-    getNextToken(); // eat '='
-    Exp *lhs = EXP_NEW(exp_declaration, type, varName);
+static ExpId Exp_newIf(struct ExpIf branch)
+{
+    AST_PUSH(ifs, branch);
+    return Exp_new(exp_if, Nodes->ifs.size - 1);
+}
 
-    if (CurTok == ';')
+// Copies a finished child list into the shared lists array, returning
+// where the range starts
+static uint32_t Exp_list(ExpId *items, size_t size)
+{
+    uint32_t begin = Nodes->lists.size;
+    VEC_RESERVE(Nodes->lists.items, Nodes->lists.allocated, Nodes->lists.size + size);
+    if (size > 0)
     {
-        return lhs;
+        memcpy(&Nodes->lists.items[begin], items, sizeof(ExpId) * size);
     }
+    Nodes->lists.size += size;
+    return begin;
+}
 
-    getNextToken(); // advance to expression
-    Exp *body = ParseExpression();
+// bytes used by the node arrays
+static size_t Ast_bytes(struct Ast *ast)
+{
+    return ast->size * (sizeof(uint8_t) + sizeof(uint32_t) + sizeof(struct SourceLoc))
+        + ast->ints.size * sizeof(int)
+        + ast->vars.size * sizeof(struct ExpVar)
+        + ast->adds.size * sizeof(struct ExpAdd)
+        + ast->calls.size * sizeof(struct ExpCall)
+        + ast->functions.size * sizeof(struct ExpFunction)
+        + ast->assignments.size * sizeof(struct ExpAssignment)
+        + ast->declarations.size * sizeof(struct ExpDeclaration)
+        + ast->stringlits.size * sizeof(int)
+        + ast->indexes.size * sizeof(struct ExpIndex)
+        + ast->returns.size * sizeof(ExpId)
+        + ast->compares.size * sizeof(struct ExpCompare)
+        + ast->ifs.size * sizeof(struct ExpIf)
+        + ast->lists.size * sizeof(ExpId)
+        + ast->params.size * sizeof(struct ExpParam);
+}
 
-    if (body == NULL)
+void Exp_printPrototype(struct ExpFunction *fn)
+{
+    printf("%s(", fn->name);
+    for (uint32_t i = 0; i < fn->numParams; i++)
     {
-        free(lhs);
-        exit(-1);
+        struct ExpParam *param = &Nodes->params.items[fn->params + i];
+        printf("%s%s: %s", i == 0 ? "" : ", ", param->name, param->type);
     }
-
-    Exp *expr = EXP_NEW(exp_assignment, lhs, body);
-
-    if (CurTok != ';')
+    printf(")");
+    if (fn->retType != NULL)
     {
-        printf("expected ; after variable declaration");
-        exit(-1);
+        printf(": %s", fn->retType);
     }
-
-    return expr;
 }
 
-static Exp *ParseParenExpr()
+// Names are the only thing nodes own, so freeing is a pass over the kinds
+// that have them
+static void Ast_free(struct Ast *ast)
 {
-    getNextToken(); // eat (
-    Exp *exp = ParseExpression();
-    if (!exp)
-        return NULL;
+    Ctx->astNodes += ast->size;
+    Ctx->astBytes += Ast_bytes(ast);
 
-    if (CurTok != ')')
+    for (size_t i = 0; i < ast->vars.size; i++)
     {
-        printf("expected ')'");
-        exit(-1);
+        free(ast->vars.items[i].name);
     }
-    getNextToken();
-    return exp;
-}
-
-static struct exp_prototype *ParsePrototype()
-{
-    if (CurTok != tok_identifier)
+    for (size_t i = 0; i < ast->calls.size; i++)
     {
-        printf("Expected function name");
-        exit(-1);
+        free(ast->calls.items[i].callee);
     }
-
-    char *fnName = IdentifierStr;
-    getNextToken();
-
-    char **argNames = calloc(1, sizeof(char *));
-    int allocated = 1;
-    int idx = 0;
-    while((getNextToken() == tok_identifier))
+    for (size_t i = 0; i < ast->functions.size; i++)
     {
-        if (!(idx < allocated))
-        {
-            char **temp = realloc(argNames, allocated + 1);
-            if (temp == NULL)
-            {
-                printf("error allocating memory.");
-                exit(-1);
-            }
-            allocated++;
-            argNames = temp;
-        }
-
-        argNames[idx] = IdentifierStr;
-        idx++;
+        free(ast->functions.items[i].name);
     }
-
-    if (CurTok != ')')
+    for (size_t i = 0; i < ast->declarations.size; i++)
     {
-        printf("expected ')' at end of function call");
-        exit(-1);
+        free(ast->declarations.items[i].type);
+        free(ast->declarations.items[i].name);
     }
-
-    getNextToken(); // eat ')'
-    getNextToken(); // eat {
-
-    struct exp_prototype *expr = malloc(sizeof(struct exp_prototype));
-    if (expr == NULL)
+    for (size_t i = 0; i < ast->params.size; i++)
+    {
+        free(ast->params.items[i].name);
+    }
+
+    free(ast->tags);
+    free(ast->slots);
+    free(ast->locs);
+    free(ast->ints.items);
+    free(ast->vars.items);
+    free(ast->adds.items);
+    free(ast->calls.items);
+    free(ast->functions.items);
+    free(ast->assignments.items);
+    free(ast->declarations.items);
+    free(ast->stringlits.items);
+    free(ast->indexes.items);
+    free(ast->returns.items);
+    free(ast->compares.items);
+    free(ast->ifs.items);
+    free(ast->lists.items);
+    free(ast->params.items);
+    memset(ast, 0, sizeof(struct Ast));
+}
+
+char *concat(char *s1, char *s2)
+{
+    char *res = malloc(strlen(s1) + strlen(s2) + 1);
+    strlcpy(res, s1, strlen(res) + 1);
+    strlcat(res, s2, strlen(res) + strlen(s2) + 1);
+    return res;
+}
+
+// every argument has type param; numParams is -1 for any number of them
+typedef struct Builtin
+{
+    char *name;
+    char *runtime;
+    char *param;
+    int numParams;
+} Builtin;
+
+static struct Builtin Builtins[] =
+{
+    { .name = "print", .runtime = "dputs", .param = "string", .numParams = -1 },
+    { .name = "toString", .runtime = "itos", .param = "int", .numParams = 1 }
+};
+
+#define NUM_BUILTINS (sizeof(Builtins) / sizeof(Builtins[0]))
+
+static bool isBuiltin(const char *name)
+{
+    for (size_t i = 0; i < NUM_BUILTINS; i++)
+    {
+        if (strcmp(Builtins[i].name, name) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The types a value can be passed or returned as. They are returned as
+// static strings so signatures and nodes can share them without copies.
+static char *valueType(const char *type)
+{
+    if (strcmp(type, "int") == 0)
+    {
+        return "int";
+    }
+    if (strcmp(type, "string") == 0)
+    {
+        return "string";
+    }
+    compileError("cannot pass or return %s", type);
+}
+
+// What the parser knows about a function it can call: from a definition,
+// a forward declaration (a prototype ending in ;) or an imported
+// interface. Calls are checked against it as they are parsed, so a
+// function has to be declared before its first call. Only the parser
+// uses it, codegen reads the types copied into the nodes.
+typedef struct Signature
+{
+    char *name;
+    char *retType;      // NULL when nothing is returned
+    uint32_t params;    // first entry in Signatures.paramTypes
+    uint32_t numParams;
+    bool defined;       // has a body here or in an imported module
+} Signature;
+
+typedef struct Signatures
+{
+    struct StrMap byName;   // name -> index into items
+    struct Signature *items;
+    size_t size;
+    size_t allocated;
+    char **paramTypes;
+    size_t numParamTypes;
+    size_t paramTypesAllocated;
+} Signatures;
+
+static struct Signature *Signature_find(const char *name)
+{
+    long *idx = StrMap_get(&Ctx->signatures->byName, name);
+    return idx == NULL ? NULL : &Ctx->signatures->items[*idx];
+}
+
+// Records a prototype, returning its index. Repeated prototypes must
+// agree and only one of them may come with a body.
+static long Signature_declare(const char *name, char *retType, char **paramTypes, uint32_t numParams, bool defined)
+{
+    if (isBuiltin(name))
+    {
+        compileError("%s is a builtin", name);
+    }
+
+    struct Signatures *sigs = Ctx->signatures;
+    long *idx = StrMap_get(&sigs->byName, name);
+    if (idx != NULL)
+    {
+        struct Signature *sig = &sigs->items[*idx];
+        bool same = sig->retType == retType && sig->numParams == numParams;
+        for (uint32_t i = 0; same && i < numParams; i++)
+        {
+            same = sigs->paramTypes[sig->params + i] == paramTypes[i];
+        }
+        if (!same)
+        {
+            compileError("conflicting declarations of %s", name);
+        }
+        if (sig->defined && defined)
+        {
+            compileError("%s is defined more than once", name);
+        }
+        sig->defined |= defined;
+        return *idx;
+    }
+
+    struct Signature sig = { .name = copyString(name), .retType = retType, .params = sigs->numParamTypes, .numParams = numParams, .defined = defined };
+    for (uint32_t i = 0; i < numParams; i++)
+    {
+        VEC_PUSH(sigs->paramTypes, sigs->numParamTypes, sigs->paramTypesAllocated, paramTypes[i]);
+    }
+    StrMap_set(&sigs->byName, name, sigs->size);
+    VEC_PUSH(sigs->items, sigs->size, sigs->allocated, sig);
+    return sigs->size - 1;
+}
+
+static void Signatures_free()
+{
+    struct Signatures *sigs = Ctx->signatures;
+    for (size_t i = 0; i < sigs->size; i++)
+    {
+        free(sigs->items[i].name);
+    }
+    free(sigs->items);
+    free(sigs->paramTypes);
+    StrMap_free(&sigs->byName);
+    *sigs = (struct Signatures) { .items = NULL, .size = 0, .allocated = 0 };
+}
+
+// Interface files (.fci) describe the functions a module marks with
+// expose, so other modules can check calls against them without the
+// source. The file is read in place through mmap:
+//
+//   InterfaceHeader
+//   InterfaceFunction[numFunctions]
+//   uint8_t paramTypes[numParams]   per function, indexed by params
+//   char strings[stringsSize]       NUL-terminated names
+//
+// No bodies or string literals are written, only signatures.
+#define INTERFACE_MAGIC "FCI"
+#define INTERFACE_VERSION 2
+
+enum InterfaceType
+{
+    iface_unused,   // reserved, 0 is never a valid type
+    iface_int,
+    iface_string,
+    iface_void      // return type of functions without a value
+};
+
+typedef struct InterfaceHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t numFunctions;
+    uint32_t numParams;
+    uint32_t stringsSize;
+    uint32_t module;    // offset of the module name in strings
+} InterfaceHeader;
+
+typedef struct InterfaceFunction
+{
+    uint32_t name;      // offset into strings
+    uint32_t params;    // index of the first parameter type
+    uint16_t numParams;
+    uint8_t retType;
+    uint8_t flags;
+} InterfaceFunction;
+
+typedef struct InterfaceExport
+{
+    char *name;
+    long signature;
+} InterfaceExport;
+
+typedef struct Interface
+{
+    void *map;
+    size_t size;
+    const struct InterfaceHeader *header;
+    const struct InterfaceFunction *functions;
+    const uint8_t *paramTypes;
+    const char *strings;
+} Interface;
+
+typedef struct Interfaces
+{
+    struct InterfaceExport *exports;    // exposed by the module being compiled
+    size_t numExports;
+    size_t exportsAllocated;
+
+    struct Interface *imports;
+    size_t numImports;
+    size_t importsAllocated;
+} Interfaces;
+
+static uint8_t Interface_type(const char *type)
+{
+    if (type == NULL)
+    {
+        return iface_void;
+    }
+    return strcmp(type, "int") == 0 ? iface_int : iface_string;
+}
+
+static void Interface_addExport(char *name, long signature)
+{
+    struct InterfaceExport export = { .name = copyString(name), .signature = signature };
+    VEC_PUSH(Ctx->interfaces->exports, Ctx->interfaces->numExports, Ctx->interfaces->exportsAllocated, export);
+}
+
+static void Interface_write(const char *path, const char *module)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        compileError("could not write %s", path);
+    }
+
+    struct InterfaceHeader header = { .magic = INTERFACE_MAGIC, .version = INTERFACE_VERSION, .numFunctions = Ctx->interfaces->numExports };
+    size_t stringsSize = strlen(module) + 1;
+    for (size_t i = 0; i < Ctx->interfaces->numExports; i++)
+    {
+        header.numParams += Ctx->signatures->items[Ctx->interfaces->exports[i].signature].numParams;
+        stringsSize += strlen(Ctx->interfaces->exports[i].name) + 1;
+    }
+    header.stringsSize = stringsSize;
+    header.module = 0;
+    fwrite(&header, sizeof(header), 1, file);
+
+    uint32_t name = strlen(module) + 1;
+    uint32_t params = 0;
+    for (size_t i = 0; i < Ctx->interfaces->numExports; i++)
+    {
+        struct InterfaceExport *export = &Ctx->interfaces->exports[i];
+        struct Signature *sig = &Ctx->signatures->items[export->signature];
+        struct InterfaceFunction fn = { .name = name, .params = params, .numParams = sig->numParams, .retType = Interface_type(sig->retType) };
+        fwrite(&fn, sizeof(fn), 1, file);
+        name += strlen(export->name) + 1;
+        params += sig->numParams;
+    }
+
+    for (size_t i = 0; i < Ctx->interfaces->numExports; i++)
+    {
+        struct Signature *sig = &Ctx->signatures->items[Ctx->interfaces->exports[i].signature];
+        for (uint32_t p = 0; p < sig->numParams; p++)
+        {
+            fputc(Interface_type(Ctx->signatures->paramTypes[sig->params + p]), file);
+        }
+    }
+
+    fwrite(module, 1, strlen(module) + 1, file);
+    for (size_t i = 0; i < Ctx->interfaces->numExports; i++)
+    {
+        fwrite(Ctx->interfaces->exports[i].name, 1, strlen(Ctx->interfaces->exports[i].name) + 1, file);
+    }
+
+    if (fclose(file) != 0)
+    {
+        compileError("could not write %s", path);
+    }
+}
+
+static void Interface_corrupt(const char *path)
+{
+    compileError("%s is not a valid interface file", path);
+}
+
+static void Interface_import(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        compileError("interface %s not found.", path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct InterfaceHeader))
+    {
+        Interface_corrupt(path);
+    }
+
+    struct Interface iface = { .size = st.st_size };
+    iface.map = mmap(NULL, iface.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (iface.map == MAP_FAILED)
+    {
+        Interface_corrupt(path);
+    }
+    // recorded right away so the map is released even if a check fails
+    VEC_PUSH(Ctx->interfaces->imports, Ctx->interfaces->numImports, Ctx->interfaces->importsAllocated, iface);
+
+    iface.header = iface.map;
+    const struct InterfaceHeader *header = iface.header;
+    size_t tableSize = sizeof(struct InterfaceHeader)
+        + (size_t)header->numFunctions * sizeof(struct InterfaceFunction)
+        + header->numParams;
+    if (memcmp(header->magic, INTERFACE_MAGIC, 4) != 0 || header->version != INTERFACE_VERSION
+        || tableSize + header->stringsSize != iface.size || header->stringsSize == 0)
+    {
+        Interface_corrupt(path);
+    }
+
+    iface.functions = (const struct InterfaceFunction *)(header + 1);
+    iface.paramTypes = (const uint8_t *)(iface.functions + header->numFunctions);
+    iface.strings = (const char *)(iface.paramTypes + header->numParams);
+    if (iface.strings[header->stringsSize - 1] != '\0')
+    {
+        Interface_corrupt(path);
+    }
+
+    // the functions become signatures like any other prototype
+    static char *types[] = { [iface_int] = "int", [iface_string] = "string", [iface_void] = NULL };
+    char **paramTypes = NULL;
+    size_t allocated = 0;
+    for (uint32_t i = 0; i < header->numFunctions; i++)
+    {
+        const struct InterfaceFunction *fn = &iface.functions[i];
+        if (fn->name >= header->stringsSize || (size_t)fn->params + fn->numParams > header->numParams
+            || (fn->retType != iface_int && fn->retType != iface_string && fn->retType != iface_void))
+        {
+            Interface_corrupt(path);
+        }
+
+        VEC_RESERVE(paramTypes, allocated, (size_t)fn->numParams + 1);
+        for (uint16_t p = 0; p < fn->numParams; p++)
+        {
+            uint8_t type = iface.paramTypes[fn->params + p];
+            if (type != iface_int && type != iface_string)
+            {
+                Interface_corrupt(path);
+            }
+            paramTypes[p] = types[type];
+        }
+        Signature_declare(iface.strings + fn->name, types[fn->retType], paramTypes, fn->numParams, true);
+    }
+    free(paramTypes);
+}
+
+static void Interfaces_free()
+{
+    for (size_t i = 0; i < Ctx->interfaces->numExports; i++)
+    {
+        free(Ctx->interfaces->exports[i].name);
+    }
+    free(Ctx->interfaces->exports);
+    for (size_t i = 0; i < Ctx->interfaces->numImports; i++)
+    {
+        munmap(Ctx->interfaces->imports[i].map, Ctx->interfaces->imports[i].size);
+    }
+    free(Ctx->interfaces->imports);
+    *Ctx->interfaces = (struct Interfaces) { .numExports = 0, .numImports = 0 };
+}
+
+// Codegen lowers each function into an IlFunction first and only prints
+// it as QBE text once it is complete, so the instructions can be counted
+// and rewritten on the way out.
+enum IlOp
+{
+    il_label,
+    il_copy,
+    il_add,
+    il_sub,
+    il_loadl,
+    il_storel,
+    il_call,
+    il_jmp,
+    il_jnz,
+    il_ret,
+    il_dbgloc,
+    il_mul,
+    il_extsw,
+    il_loadw,
+    il_storew,
+    il_alloc4,
+    il_check,
+    il_ceqw,
+    il_cnew,
+    il_csltw,
+    il_cslew,
+    il_csgtw,
+    il_csgew
+};
+
+static const char *IlOpNames[] =
+{
+    [il_label] = "label",
+    [il_copy] = "copy",
+    [il_add] = "add",
+    [il_sub] = "sub",
+    [il_loadl] = "loadl",
+    [il_storel] = "storel",
+    [il_call] = "call",
+    [il_jmp] = "jmp",
+    [il_jnz] = "jnz",
+    [il_ret] = "ret",
+    [il_dbgloc] = "dbgloc",
+    [il_mul] = "mul",
+    [il_extsw] = "extsw",
+    [il_loadw] = "loadw",
+    [il_storew] = "storew",
+    [il_alloc4] = "alloc4",
+    [il_check] = "check",
+    [il_ceqw] = "ceqw",
+    [il_cnew] = "cnew",
+    [il_csltw] = "csltw",
+    [il_cslew] = "cslew",
+    [il_csgtw] = "csgtw",
+    [il_csgew] = "csgew"
+};
+
+static bool IlOp_isCompare(enum IlOp op)
+{
+    return op >= il_ceqw && op <= il_csgew;
+}
+
+typedef struct IlArg
+{
+    char type;   // only set for call arguments
+    char *val;
+} IlArg;
+
+typedef struct IlIns
+{
+    enum IlOp op;
+    char type;       // result type, 0 without a result
+    bool invariant;  // loads memory that is never written after creation
+    char *dest;
+    char *callee;
+    struct IlArg *args;
+    int numArgs;
+} IlIns;
+
+typedef struct IlFunction
+{
+    char *name;
+    bool exported;
+    char retType;
+    struct IlArg *params;   // type and %name, passed in registers by the ABI
+    int numParams;
+    char *section;   // static string, NULL for the default .text
+    int numTemps;
+    int numChecks;
+    int numBranches;
+    struct IlIns *ins;
+    size_t size;
+    size_t allocated;
+    // blocks lowered out of line, appended after the rest of the function
+    struct IlIns *cold;
+    size_t coldSize;
+    size_t coldAllocated;
+    // the storage of each array declaration in source order, allocated
+    // in @start; nextArray is the next declaration to be lowered
+    char **arrays;
+    size_t numArrays;
+    size_t arraysAllocated;
+    size_t nextArray;
+    // the arrays among them on the heap, freed before every ret
+    char **heapArrays;
+    size_t numHeapArrays;
+    size_t heapArraysAllocated;
+} IlFunction;
+
+typedef struct IlNum { char s[24]; } IlNum;
+
+static struct IlNum Il_num(long val)
+{
+    struct IlNum num;
+    snprintf(num.s, sizeof(num.s), "%ld", val);
+    return num;
+}
+
+static struct IlIns *Il_append(enum IlOp op, char type, const char *dest, int numArgs)
+{
+    struct IlFunction *fn = Ctx->CurFn;
+    VEC_RESERVE(fn->ins, fn->allocated, fn->size + 1);
+
+    struct IlIns *ins = &fn->ins[fn->size++];
+    *ins = (struct IlIns) { .op = op, .type = type, .dest = copyString(dest), .numArgs = numArgs };
+    ins->args = numArgs > 0 ? calloc(numArgs, sizeof(struct IlArg)) : NULL;
+    return ins;
+}
+
+// operands are passed as strings and copied: "%tmp", "$global" or a number
+static void Il_emit(enum IlOp op, char type, const char *dest, int numArgs, ...)
+{
+    struct IlIns *ins = Il_append(op, type, dest, numArgs);
+    va_list args;
+    va_start(args, numArgs);
+    for (int i = 0; i < numArgs; i++)
+    {
+        ins->args[i].val = copyString(va_arg(args, const char *));
+    }
+    va_end(args);
+}
+
+// arguments are passed as type, value pairs: 'w', "%x", 'l', "$sl0"
+static void Il_call(char type, const char *dest, const char *callee, int numArgs, ...)
+{
+    struct IlIns *ins = Il_append(il_call, type, dest, numArgs);
+    ins->callee = copyString(callee);
+    va_list args;
+    va_start(args, numArgs);
+    for (int i = 0; i < numArgs; i++)
+    {
+        ins->args[i].type = va_arg(args, int);
+        ins->args[i].val = copyString(va_arg(args, const char *));
+    }
+    va_end(args);
+}
+
+// the last emitted load reads immutable memory, such as a string header
+static void Il_markInvariant()
+{
+    Ctx->CurFn->ins[Ctx->CurFn->size - 1].invariant = true;
+}
+
+static void Il_label(const char *name)
+{
+    Il_emit(il_label, 0, NULL, 1, name);
+}
+
+// Fails at runtime unless 0 <= index < length. Il_elimChecks removes the
+// ones that cannot fail.
+static void Il_check(const char *index, long length)
+{
+    Il_emit(il_check, 0, NULL, 3, index, Il_num(length).s, Il_num(Ctx->CurFn->numChecks++).s);
+}
+
+// with -g, attributes the following instructions to a source line
+static void Il_dbgloc(struct SourceLoc loc)
+{
+    Il_emit(il_dbgloc, 0, NULL, 2, Il_num(loc.line).s, Il_num(loc.column).s);
+}
+
+static void IlIns_free(struct IlIns *ins)
+{
+    for (int i = 0; i < ins->numArgs; i++)
+    {
+        free(ins->args[i].val);
+    }
+    free(ins->args);
+    free(ins->dest);
+    free(ins->callee);
+}
+
+static void IlFunction_free(struct IlFunction *fn)
+{
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        IlIns_free(&fn->ins[i]);
+    }
+    free(fn->ins);
+    for (size_t i = 0; i < fn->coldSize; i++)
+    {
+        IlIns_free(&fn->cold[i]);
+    }
+    free(fn->cold);
+    for (size_t i = 0; i < fn->numArrays; i++)
+    {
+        free(fn->arrays[i]);
+    }
+    free(fn->arrays);
+    free(fn->heapArrays);
+    free(fn->name);
+    for (int i = 0; i < fn->numParams; i++)
+    {
+        free(fn->params[i].val);
+    }
+    free(fn->params);
+}
+
+static void IlIns_print(struct IlIns *ins, FILE *out)
+{
+    if (ins->op == il_label)
+    {
+        fprintf(out, "%s\n", ins->args[0].val);
+        return;
+    }
+
+    // check index, length, n: unsigned compare so negative indices fail too
+    if (ins->op == il_check)
+    {
+        char *n = ins->args[2].val;
+        fprintf(out, "    %%.b%s =w cultw %s, %s\n", n, ins->args[0].val, ins->args[1].val);
+        fprintf(out, "    jnz %%.b%s, @b%s.ok, @b%s.fail\n", n, n, n);
+        fprintf(out, "@b%s.fail\n", n);
+        fprintf(out, "    call $bounds_fail(w %s, w %s)\n", ins->args[0].val, ins->args[1].val);
+        fprintf(out, "@b%s.ok\n", n);
+        return;
+    }
+
+    fprintf(out, "    ");
+    if (ins->dest != NULL)
+    {
+        fprintf(out, "%s =%c ", ins->dest, ins->type);
+    }
+
+    if (ins->op == il_call)
+    {
+        fprintf(out, "call %s(", ins->callee);
+        for (int i = 0; i < ins->numArgs; i++)
+        {
+            fprintf(out, "%s%c %s", i == 0 ? "" : ", ", ins->args[i].type, ins->args[i].val);
+        }
+        fprintf(out, ")\n");
+        return;
+    }
+
+    fprintf(out, "%s", IlOpNames[ins->op]);
+    for (int i = 0; i < ins->numArgs; i++)
+    {
+        fprintf(out, "%s%s", i == 0 ? " " : ", ", ins->args[i].val);
+    }
+    fprintf(out, "\n");
+}
+
+static void IlFunction_print(struct IlFunction *fn, FILE *out)
+{
+    fprintf(out, "%s", fn->exported ? "export " : "");
+    if (fn->section != NULL)
+    {
+        fprintf(out, "section \"%s\" ", fn->section);
+    }
+    fprintf(out, "function ");
+    if (fn->retType != 0)
+    {
+        fprintf(out, "%c ", fn->retType);
+    }
+    fprintf(out, "$%s(", fn->name);
+    for (int i = 0; i < fn->numParams; i++)
+    {
+        fprintf(out, "%s%c %s", i == 0 ? "" : ", ", fn->params[i].type, fn->params[i].val);
+    }
+    fprintf(out, ") {\n");
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        IlIns_print(&fn->ins[i], out);
+    }
+    fprintf(out, "}\n");
+}
+
+// Writes one data definition either as QBE data or as GNU as directives.
+// Symbol names are given without the leading $.
+typedef struct DataWriter
+{
+    FILE *out;
+    bool first;
+} DataWriter;
+
+static struct DataWriter Data_begin(FILE *out, const char *name)
+{
+    if (Ctx->options.backend == backend_x86)
+    {
+        fprintf(out, ".data\n.balign 8\n%s:\n", name);
+    } else
+    {
+        fprintf(out, "data $%s = { ", name);
+    }
+    return (struct DataWriter) { .out = out, .first = true };
+}
+
+static void Data_separate(struct DataWriter *data)
+{
+    if (Ctx->options.backend == backend_qbe && !data->first)
+    {
+        fprintf(data->out, ", ");
+    }
+    data->first = false;
+}
+
+static void Data_long(struct DataWriter *data, long val)
+{
+    Data_separate(data);
+    fprintf(data->out, Ctx->options.backend == backend_x86 ? "    .quad %ld\n" : "l %ld", val);
+}
+
+static void Data_symbol(struct DataWriter *data, const char *name)
+{
+    Data_separate(data);
+    fprintf(data->out, Ctx->options.backend == backend_x86 ? "    .quad %s\n" : "l $%s", name);
+}
+
+// Bytes go out as string directives of up to DATA_LINE bytes each.
+// Printable characters are written as is, the rest as octal escapes,
+// which QBE passes through to the assembler.
+#define DATA_LINE 4096
+
+static void Data_bytes(struct DataWriter *data, const char *bytes, size_t len)
+{
+    char line[DATA_LINE * 4];
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t stop = i + DATA_LINE < len ? i + DATA_LINE : len;
+        size_t n = 0;
+        for (; i < stop; i++)
+        {
+            unsigned char c = bytes[i];
+            if (c >= ' ' && c <= '~' && c != '"' && c != '\\')
+            {
+                line[n++] = c;
+                continue;
+            }
+            line[n++] = '\\';
+            line[n++] = '0' + (c >> 6);
+            line[n++] = '0' + ((c >> 3) & 7);
+            line[n++] = '0' + (c & 7);
+        }
+        Data_separate(data);
+        fprintf(data->out, Ctx->options.backend == backend_x86 ? "    .ascii \"%.*s\"\n" : "b \"%.*s\"", (int)n, line);
+    }
+}
+
+static void Data_string(struct DataWriter *data, const char *str)
+{
+    Data_bytes(data, str, strlen(str));
+}
+
+static void Data_byte(struct DataWriter *data, int val)
+{
+    Data_separate(data);
+    fprintf(data->out, Ctx->options.backend == backend_x86 ? "    .byte %d\n" : "b %d", val);
+}
+
+static void Data_end(struct DataWriter *data)
+{
+    if (Ctx->options.backend == backend_qbe)
+    {
+        fprintf(data->out, " }\n");
+    }
+}
+
+// Direct x86-64 System V backend for debug builds: each IlFunction is
+// turned into GNU as text without going through QBE. Temporaries get one
+// live interval over the linear instruction order, widened across
+// backward jumps, and are assigned callee-saved registers by linear scan.
+// The rest live in stack slots. Scratch registers never hold a value
+// across instructions, so nothing needs saving around calls.
+#define X86_NUM_REGS 5
+#define X86_NUM_ARG_REGS 6
+
+static const char *X86Regs64[X86_NUM_REGS] = { "%rbx", "%r12", "%r13", "%r14", "%r15" };
+static const char *X86Regs32[X86_NUM_REGS] = { "%ebx", "%r12d", "%r13d", "%r14d", "%r15d" };
+static const char *X86ArgRegs64[X86_NUM_ARG_REGS] = { "%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9" };
+static const char *X86ArgRegs32[X86_NUM_ARG_REGS] = { "%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d" };
+
+typedef struct X86Reg
+{
+    const char *r64;
+    const char *r32;
+} X86Reg;
+
+static const struct X86Reg X86Rax = { "%rax", "%eax" };
+static const struct X86Reg X86Rcx = { "%rcx", "%ecx" };
+
+typedef struct X86Interval
+{
+    char *name;
+    size_t start;
+    size_t end;
+    int reg;     // index into X86Regs, -1 when spilled
+    int slot;
+} X86Interval;
+
+typedef struct X86Alloc
+{
+    struct StrMap byName;
+    struct X86Interval *intervals;
+    size_t size;
+    size_t allocated;
+    int numSlots;
+    bool usedRegs[X86_NUM_REGS];
+} X86Alloc;
+
+static void X86Alloc_touch(struct X86Alloc *alloc, char *name, size_t pos)
+{
+    if (name == NULL || name[0] != '%')
+    {
+        return;
+    }
+
+    long *idx = StrMap_get(&alloc->byName, name);
+    if (idx != NULL)
+    {
+        struct X86Interval *interval = &alloc->intervals[*idx];
+        interval->start = pos < interval->start ? pos : interval->start;
+        interval->end = pos > interval->end ? pos : interval->end;
+        return;
+    }
+
+    StrMap_set(&alloc->byName, name, alloc->size);
+    struct X86Interval interval = { .name = name, .start = pos, .end = pos, .reg = -1, .slot = -1 };
+    VEC_PUSH(alloc->intervals, alloc->size, alloc->allocated, interval);
+}
+
+// A value live anywhere in a loop may be needed on the next trip round,
+// so intervals overlapping [label, backward jump] are stretched to cover
+// all of it, until no interval changes.
+static void X86Alloc_extendLoops(struct X86Alloc *alloc, struct IlFunction *fn)
+{
+    struct StrMap labels = { .entries = NULL, .size = 0, .allocated = 0 };
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        if (fn->ins[i].op == il_label)
+        {
+            StrMap_set(&labels, fn->ins[i].args[0].val, i);
+        }
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t i = 0; i < fn->size; i++)
+        {
+            struct IlIns *ins = &fn->ins[i];
+            if (ins->op != il_jmp && ins->op != il_jnz)
+            {
+                continue;
+            }
+
+            for (int a = ins->op == il_jnz ? 1 : 0; a < ins->numArgs; a++)
+            {
+                long *target = StrMap_get(&labels, ins->args[a].val);
+                if (target == NULL || (size_t)*target > i)
+                {
+                    continue;
+                }
+
+                size_t loopStart = *target;
+                for (size_t t = 0; t < alloc->size; t++)
+                {
+                    struct X86Interval *interval = &alloc->intervals[t];
+                    if (interval->end < loopStart || interval->start > i)
+                    {
+                        continue;
+                    }
+                    if (interval->start > loopStart || interval->end < i)
+                    {
+                        interval->start = interval->start < loopStart ? interval->start : loopStart;
+                        interval->end = interval->end > i ? interval->end : i;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+    StrMap_free(&labels);
+}
+
+static int X86Interval_compare(const void *a, const void *b)
+{
+    const struct X86Interval *l = a;
+    const struct X86Interval *r = b;
+    if (l->start != r->start)
+    {
+        return l->start < r->start ? -1 : 1;
+    }
+    return 0;
+}
+
+static void X86Alloc_run(struct X86Alloc *alloc, struct IlFunction *fn)
+{
+    // parameters are stored on entry, before the first instruction
+    for (int i = 0; i < fn->numParams; i++)
+    {
+        X86Alloc_touch(alloc, fn->params[i].val, 0);
+    }
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        struct IlIns *ins = &fn->ins[i];
+        X86Alloc_touch(alloc, ins->dest, i);
+        for (int a = 0; a < ins->numArgs; a++)
+        {
+            X86Alloc_touch(alloc, ins->args[a].val, i);
+        }
+    }
+    X86Alloc_extendLoops(alloc, fn);
+
+    qsort(alloc->intervals, alloc->size, sizeof(struct X86Interval), X86Interval_compare);
+    StrMap_free(&alloc->byName);
+    for (size_t i = 0; i < alloc->size; i++)
+    {
+        StrMap_set(&alloc->byName, alloc->intervals[i].name, i);
+    }
+
+    // active[r] is the interval currently holding register r
+    struct X86Interval *active[X86_NUM_REGS] = { NULL };
+    for (size_t i = 0; i < alloc->size; i++)
+    {
+        struct X86Interval *cur = &alloc->intervals[i];
+        int freeReg = -1;
+        int furthest = -1;
+        for (int r = 0; r < X86_NUM_REGS; r++)
+        {
+            if (active[r] != NULL && active[r]->end < cur->start)
+            {
+                active[r] = NULL;
+            }
+            if (active[r] == NULL)
+            {
+                freeReg = freeReg < 0 ? r : freeReg;
+            } else if (furthest < 0 || active[r]->end > active[furthest]->end)
+            {
+                furthest = r;
+            }
+        }
+
+        if (freeReg >= 0)
+        {
+            cur->reg = freeReg;
+            active[freeReg] = cur;
+            alloc->usedRegs[freeReg] = true;
+            continue;
+        }
+
+        // spill whichever of the active intervals and this one ends last
+        if (active[furthest]->end > cur->end)
+        {
+            cur->reg = furthest;
+            active[furthest]->reg = -1;
+            active[furthest]->slot = alloc->numSlots++;
+            active[furthest] = cur;
+        } else
+        {
+            cur->slot = alloc->numSlots++;
+        }
+    }
+}
+
+static void X86Alloc_free(struct X86Alloc *alloc)
+{
+    free(alloc->intervals);
+    StrMap_free(&alloc->byName);
+}
+
+typedef struct X86Frame
+{
+    FILE *out;
+    struct X86Alloc alloc;
+    struct IlFunction *fn;
+    int numSaved;
+    bool dynamicStack;  // alloc4 moves %rsp below the fixed frame
+} X86Frame;
+
+static struct X86Interval *X86_interval(struct X86Frame *frame, const char *name)
+{
+    long *idx = StrMap_get(&frame->alloc.byName, name);
+    return idx == NULL ? NULL : &frame->alloc.intervals[*idx];
+}
+
+static int X86_slotOffset(struct X86Frame *frame, int slot)
+{
+    return -8 * (frame->numSaved + slot + 1);
+}
+
+static bool X86_fitsImm32(const char *val)
+{
+    long num = strtol(val, NULL, 10);
+    return num >= INT32_MIN && num <= INT32_MAX;
+}
+
+// Puts the value of operand val into reg
+static void X86_load(struct X86Frame *frame, const char *val, char type, struct X86Reg reg)
+{
+    FILE *out = frame->out;
+    bool wide = type != 'w';
+    const char *dst = wide ? reg.r64 : reg.r32;
+    char suffix = wide ? 'q' : 'l';
+
+    if (val[0] == '$')
+    {
+        fprintf(out, "    leaq %s(%%rip), %s\n", val + 1, reg.r64);
+        return;
+    }
+
+    if (val[0] != '%')
+    {
+        if (wide && !X86_fitsImm32(val))
+        {
+            fprintf(out, "    movabsq $%s, %s\n", val, reg.r64);
+        } else
+        {
+            fprintf(out, "    mov%c $%s, %s\n", suffix, val, dst);
+        }
+        return;
+    }
+
+    struct X86Interval *interval = X86_interval(frame, val);
+    if (interval->reg >= 0)
+    {
+        const char *src = wide ? X86Regs64[interval->reg] : X86Regs32[interval->reg];
+        if (strcmp(src, dst) != 0)
+        {
+            fprintf(out, "    mov%c %s, %s\n", suffix, src, dst);
+        }
+        return;
+    }
+    fprintf(out, "    mov%c %d(%%rbp), %s\n", suffix, X86_slotOffset(frame, interval->slot), dst);
+}
+
+// Writes reg into the temporary dest
+static void X86_store(struct X86Frame *frame, const char *dest, char type, struct X86Reg reg)
+{
+    bool wide = type != 'w';
+    const char *src = wide ? reg.r64 : reg.r32;
+    char suffix = wide ? 'q' : 'l';
+    struct X86Interval *interval = X86_interval(frame, dest);
+    if (interval->reg >= 0)
+    {
+        const char *dst = wide ? X86Regs64[interval->reg] : X86Regs32[interval->reg];
+        fprintf(frame->out, "    mov%c %s, %s\n", suffix, src, dst);
+        return;
+    }
+    fprintf(frame->out, "    mov%c %s, %d(%%rbp)\n", suffix, src, X86_slotOffset(frame, interval->slot));
+}
+
+static void X86_label(struct X86Frame *frame, const char *label)
+{
+    // QBE labels start with @
+    fprintf(frame->out, ".L%s_%s", frame->fn->name, label + 1);
+}
+
+static void X86_call(struct X86Frame *frame, struct IlIns *ins)
+{
+    FILE *out = frame->out;
+    int stackArgs = ins->numArgs > X86_NUM_ARG_REGS ? ins->numArgs - X86_NUM_ARG_REGS : 0;
+    int padding = stackArgs % 2 == 1 ? 8 : 0;
+    if (padding != 0)
+    {
+        fprintf(out, "    subq $8, %%rsp\n");
+    }
+    for (int i = ins->numArgs - 1; i >= X86_NUM_ARG_REGS; i--)
+    {
+        X86_load(frame, ins->args[i].val, 'l', X86Rax);
+        fprintf(out, "    pushq %%rax\n");
+    }
+
+    for (int i = 0; i < ins->numArgs && i < X86_NUM_ARG_REGS; i++)
+    {
+        struct X86Reg reg = { X86ArgRegs64[i], X86ArgRegs32[i] };
+        X86_load(frame, ins->args[i].val, ins->args[i].type, reg);
+    }
+
+    // %al holds the number of vector registers for variadic callees
+    fprintf(out, "    xorl %%eax, %%eax\n");
+    fprintf(out, "    call %s@PLT\n", ins->callee + 1);
+    if (stackArgs > 0)
+    {
+        fprintf(out, "    addq $%d, %%rsp\n", stackArgs * 8 + padding);
+    }
+    if (ins->dest != NULL)
+    {
+        X86_store(frame, ins->dest, ins->type, X86Rax);
+    }
+}
+
+static void X86_ins(struct X86Frame *frame, struct IlIns *ins)
+{
+    FILE *out = frame->out;
+    char suffix = ins->type == 'w' ? 'l' : 'q';
+    switch (ins->op)
+    {
+        case il_label:
+            X86_label(frame, ins->args[0].val);
+            fprintf(out, ":\n");
+            return;
+
+        case il_copy:
+            X86_load(frame, ins->args[0].val, ins->type, X86Rax);
+            X86_store(frame, ins->dest, ins->type, X86Rax);
+            return;
+
+        case il_add:
+        case il_sub:
+            X86_load(frame, ins->args[0].val, ins->type, X86Rax);
+            X86_load(frame, ins->args[1].val, ins->type, X86Rcx);
+            fprintf(out, "    %s%c %s, %s\n", ins->op == il_add ? "add" : "sub", suffix,
+                    ins->type == 'w' ? "%ecx" : "%rcx", ins->type == 'w' ? "%eax" : "%rax");
+            X86_store(frame, ins->dest, ins->type, X86Rax);
+            return;
+
+        case il_loadl:
+            X86_load(frame, ins->args[0].val, 'l', X86Rax);
+            fprintf(out, "    movq (%%rax), %%rax\n");
+            X86_store(frame, ins->dest, 'l', X86Rax);
+            return;
+
+        case il_storel:
+            X86_load(frame, ins->args[0].val, 'l', X86Rax);
+            X86_load(frame, ins->args[1].val, 'l', X86Rcx);
+            fprintf(out, "    movq %%rax, (%%rcx)\n");
+            return;
+
+        case il_call:
+            X86_call(frame, ins);
+            return;
+
+        case il_ceqw:
+        case il_cnew:
+        case il_csltw:
+        case il_cslew:
+        case il_csgtw:
+        case il_csgew:
+        {
+            static const char *conditions[] = { "e", "ne", "l", "le", "g", "ge" };
+            X86_load(frame, ins->args[0].val, 'w', X86Rax);
+            X86_load(frame, ins->args[1].val, 'w', X86Rcx);
+            fprintf(out, "    cmpl %%ecx, %%eax\n    set%s %%al\n    movzbl %%al, %%eax\n", conditions[ins->op - il_ceqw]);
+            X86_store(frame, ins->dest, 'w', X86Rax);
+            return;
+        }
+
+        case il_jmp:
+            fprintf(out, "    jmp ");
+            X86_label(frame, ins->args[0].val);
+            fprintf(out, "\n");
+            return;
+
+        case il_jnz:
+            X86_load(frame, ins->args[0].val, 'w', X86Rax);
+            fprintf(out, "    testl %%eax, %%eax\n    jnz ");
+            X86_label(frame, ins->args[1].val);
+            fprintf(out, "\n    jmp ");
+            X86_label(frame, ins->args[2].val);
+            fprintf(out, "\n");
+            return;
+
+        case il_ret:
+            if (ins->numArgs > 0 && frame->fn->retType != 0)
+            {
+                X86_load(frame, ins->args[0].val, frame->fn->retType, X86Rax);
+            }
+            fprintf(out, "    jmp .L%s_ret\n", frame->fn->name);
+            return;
+
+        case il_dbgloc:
+            fprintf(out, "    .loc 1 %s %s\n", ins->args[0].val, ins->args[1].val);
+            return;
+
+        case il_mul:
+            X86_load(frame, ins->args[0].val, ins->type, X86Rax);
+            X86_load(frame, ins->args[1].val, ins->type, X86Rcx);
+            fprintf(out, "    imul%c %s, %s\n", suffix,
+                    ins->type == 'w' ? "%ecx" : "%rcx", ins->type == 'w' ? "%eax" : "%rax");
+            X86_store(frame, ins->dest, ins->type, X86Rax);
+            return;
+
+        case il_extsw:
+            X86_load(frame, ins->args[0].val, 'w', X86Rax);
+            fprintf(out, "    movslq %%eax, %%rax\n");
+            X86_store(frame, ins->dest, 'l', X86Rax);
+            return;
+
+        case il_loadw:
+            X86_load(frame, ins->args[0].val, 'l', X86Rax);
+            fprintf(out, "    movl (%%rax), %%eax\n");
+            X86_store(frame, ins->dest, 'w', X86Rax);
+            return;
+
+        case il_storew:
+            X86_load(frame, ins->args[0].val, 'w', X86Rax);
+            X86_load(frame, ins->args[1].val, 'l', X86Rcx);
+            fprintf(out, "    movl %%eax, (%%rcx)\n");
+            return;
+
+        case il_alloc4:
+        {
+            // sizes are constants; rounding keeps %rsp aligned for calls
+            long size = (strtol(ins->args[0].val, NULL, 10) + 15) & ~15L;
+            fprintf(out, "    subq $%ld, %%rsp\n    movq %%rsp, %%rax\n", size);
+            X86_store(frame, ins->dest, 'l', X86Rax);
+            return;
+        }
+
+        case il_check:
+            X86_load(frame, ins->args[0].val, 'w', X86Rax);
+            X86_load(frame, ins->args[1].val, 'w', X86Rcx);
+            fprintf(out, "    cmpl %%ecx, %%eax\n    jb .L%s_b%s\n", frame->fn->name, ins->args[2].val);
+            fprintf(out, "    movl %%eax, %%edi\n    movl %%ecx, %%esi\n    xorl %%eax, %%eax\n");
+            fprintf(out, "    call bounds_fail@PLT\n.L%s_b%s:\n", frame->fn->name, ins->args[2].val);
+            return;
+    }
+}
+
+static void X86_printFunction(struct IlFunction *fn, FILE *out)
+{
+    struct X86Frame frame = { .out = out, .fn = fn, .alloc = { .intervals = NULL, .size = 0, .allocated = 0 } };
+    X86Alloc_run(&frame.alloc, fn);
+
+    for (int r = 0; r < X86_NUM_REGS; r++)
+    {
+        frame.numSaved += frame.alloc.usedRegs[r];
+    }
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        frame.dynamicStack |= fn->ins[i].op == il_alloc4;
+    }
+    // keep %rsp 16-byte aligned at calls: return address and %rbp are 16
+    int frameSize = 8 * (frame.numSaved + frame.alloc.numSlots);
+    int spillSize = 8 * frame.alloc.numSlots + (frameSize % 16 != 0 ? 8 : 0);
+
+    if (fn->section != NULL)
+    {
+        fprintf(out, ".section %s,\"ax\",@progbits\n", fn->section);
+    } else
+    {
+        fprintf(out, ".text\n");
+    }
+    if (fn->exported)
+    {
+        fprintf(out, ".globl %s\n", fn->name);
+    }
+    fprintf(out, ".type %s, @function\n%s:\n", fn->name, fn->name);
+    fprintf(out, "    pushq %%rbp\n    movq %%rsp, %%rbp\n");
+    for (int r = 0; r < X86_NUM_REGS; r++)
+    {
+        if (frame.alloc.usedRegs[r])
+        {
+            fprintf(out, "    pushq %s\n", X86Regs64[r]);
+        }
+    }
+    if (spillSize > 0)
+    {
+        fprintf(out, "    subq $%d, %%rsp\n", spillSize);
+    }
+
+    // the first six arrive in registers, the rest above the return address
+    for (int i = 0; i < fn->numParams; i++)
+    {
+        struct IlArg *param = &fn->params[i];
+        if (i < X86_NUM_ARG_REGS)
+        {
+            X86_store(&frame, param->val, param->type, (struct X86Reg) { X86ArgRegs64[i], X86ArgRegs32[i] });
+        } else
+        {
+            fprintf(out, "    movq %d(%%rbp), %%rax\n", 16 + 8 * (i - X86_NUM_ARG_REGS));
+            X86_store(&frame, param->val, param->type, X86Rax);
+        }
+    }
+
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        X86_ins(&frame, &fn->ins[i]);
+    }
+
+    fprintf(out, ".L%s_ret:\n", fn->name);
+    if (frame.numSaved > 0 || spillSize > 0 || frame.dynamicStack)
+    {
+        fprintf(out, "    leaq %d(%%rbp), %%rsp\n", -8 * frame.numSaved);
+    }
+    for (int r = X86_NUM_REGS - 1; r >= 0; r--)
+    {
+        if (frame.alloc.usedRegs[r])
+        {
+            fprintf(out, "    popq %s\n", X86Regs64[r]);
+        }
+    }
+    fprintf(out, "    popq %%rbp\n    ret\n");
+    fprintf(out, ".size %s, .-%s\n", fn->name, fn->name);
+
+    X86Alloc_free(&frame.alloc);
+}
+
+// calls whose result only depends on their arguments
+static const char *PureCallees[] = { "$itos" };
+
+static bool IlIns_isPure(struct IlIns *ins)
+{
+    if (ins->dest == NULL)
+    {
+        return false;
+    }
+
+    switch (ins->op)
+    {
+        case il_add:
+        case il_sub:
+        case il_mul:
+        case il_extsw:
+        case il_ceqw:
+        case il_cnew:
+        case il_csltw:
+        case il_cslew:
+        case il_csgtw:
+        case il_csgew:
+            return true;
+
+        case il_loadl:
+        case il_loadw:
+            return true;
+
+        case il_call:
+            if (ins->numArgs > 2)
+            {
+                return false;
+            }
+            for (size_t i = 0; i < sizeof(PureCallees) / sizeof(PureCallees[0]); i++)
+            {
+                if (strcmp(ins->callee, PureCallees[i]) == 0)
+                {
+                    return true;
+                }
+            }
+            return false;
+
+        default:
+            return false;
+    }
+}
+
+static bool IlIns_writesMemory(struct IlIns *ins)
+{
+    return ins->op == il_storel || ins->op == il_storew || (ins->op == il_call && !IlIns_isPure(ins));
+}
+
+// A value computed earlier in the function. It may be reused as long as
+// none of the names it was computed from (or stored in) were redefined,
+// which is checked by comparing their definition counts.
+typedef struct IlValue
+{
+    char *value;
+    char *names[3];
+    long gens[3];
+    int numNames;
+    bool load;
+} IlValue;
+
+typedef struct IlValues
+{
+    struct IlValue *values;
+    size_t size;
+    size_t allocated;
+    size_t *loads;      // indices of the values that are loads
+    size_t numLoads;
+    size_t loadsAllocated;
+    struct StrMap byKey;
+    struct StrMap gens;
+} IlValues;
+
+static long IlValues_gen(struct IlValues *vals, const char *name)
+{
+    long *gen = StrMap_get(&vals->gens, name);
+    return gen == NULL ? 0 : *gen;
+}
+
+static char *IlIns_key(struct IlIns *ins)
+{
+    size_t len = 32 + (ins->callee != NULL ? strlen(ins->callee) : 0);
+    for (int i = 0; i < ins->numArgs; i++)
+    {
+        len += strlen(ins->args[i].val) + 4;
+    }
+
+    char *key = malloc(len);
+    if (key == NULL)
+    {
+        compileError("error allocating memory");
+    }
+    int pos = snprintf(key, len, "%s %c %s", IlOpNames[ins->op], ins->type, ins->callee != NULL ? ins->callee : "");
+    for (int i = 0; i < ins->numArgs; i++)
+    {
+        pos += snprintf(key + pos, len - pos, " %c%s", ins->args[i].type != 0 ? ins->args[i].type : '_', ins->args[i].val);
+    }
+    return key;
+}
+
+static struct IlValue *IlValues_lookup(struct IlValues *vals, const char *key)
+{
+    long *idx = StrMap_get(&vals->byKey, key);
+    if (idx == NULL || *idx < 0)
+    {
+        return NULL;
+    }
+
+    struct IlValue *val = &vals->values[*idx];
+    for (int i = 0; i < val->numNames; i++)
+    {
+        if (IlValues_gen(vals, val->names[i]) != val->gens[i])
+        {
+            return NULL;
+        }
+    }
+    return val;
+}
+
+static void IlValues_add(struct IlValues *vals, const char *key, struct IlIns *ins)
+{
+    VEC_RESERVE(vals->values, vals->allocated, vals->size + 1);
+
+    struct IlValue *val = &vals->values[vals->size];
+    bool load = ins->op == il_loadl || ins->op == il_loadw;
+    *val = (struct IlValue) { .value = ins->dest, .load = load && !ins->invariant };
+    if (val->load)
+    {
+        VEC_PUSH(vals->loads, vals->numLoads, vals->loadsAllocated, vals->size);
+    }
+    val->names[val->numNames] = ins->dest;
+    val->gens[val->numNames++] = IlValues_gen(vals, ins->dest);
+    for (int i = 0; i < ins->numArgs; i++)
+    {
+        char *arg = ins->args[i].val;
+        if (arg[0] == '%')
+        {
+            val->names[val->numNames] = arg;
+            val->gens[val->numNames++] = IlValues_gen(vals, arg);
+        }
+    }
+    StrMap_set(&vals->byKey, key, vals->size++);
+}
+
+// forgets every value, used at block boundaries
+static void IlValues_clear(struct IlValues *vals)
+{
+    vals->size = 0;
+    vals->numLoads = 0;
+    StrMap_free(&vals->byKey);
+}
+
+// Forgets loaded values after memory may have changed. Only the loads
+// since the last clobber are visited, so a block full of calls stays
+// linear.
+static void IlValues_clobberLoads(struct IlValues *vals)
+{
+    for (size_t i = 0; i < vals->numLoads; i++)
+    {
+        struct IlValue *val = &vals->values[vals->loads[i]];
+        val->numNames = 1;
+        val->gens[0] = -1;
+    }
+    vals->numLoads = 0;
+}
+
+typedef struct IlRenames
+{
+    struct StrMap byName;
+    char **targets;
+    size_t size;
+    size_t allocated;
+} IlRenames;
+
+static void IlRenames_add(struct IlRenames *renames, const char *name, const char *target)
+{
+    StrMap_set(&renames->byName, name, renames->size);
+    VEC_PUSH(renames->targets, renames->size, renames->allocated, copyString(target));
+}
+
+static void IlRenames_apply(struct IlRenames *renames, struct IlArg *arg)
+{
+    long *idx = StrMap_get(&renames->byName, arg->val);
+    if (idx != NULL)
+    {
+        free(arg->val);
+        arg->val = copyString(renames->targets[*idx]);
+    }
+}
+
+static void IlRenames_free(struct IlRenames *renames)
+{
+    for (size_t i = 0; i < renames->size; i++)
+    {
+        free(renames->targets[i]);
+    }
+    free(renames->targets);
+    StrMap_free(&renames->byName);
+}
+
+static bool IlIns_readsDest(struct IlIns *ins)
+{
+    for (int i = 0; i < ins->numArgs; i++)
+    {
+        if (strcmp(ins->args[i].val, ins->dest) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool Il_isConstant(const char *val)
+{
+    return isdigit((unsigned char)val[0]) || val[0] == '-';
+}
+
+// Local value numbering over the lowered function. A pure instruction
+// that recomputes a value still held in some name is dropped when both
+// names are defined only once (later uses are renamed), or turned into a
+// copy otherwise. Labels end the region.
+static void Il_cse(struct IlFunction *fn)
+{
+    struct StrMap defs = { .entries = NULL, .size = 0, .allocated = 0 };
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        if (fn->ins[i].dest != NULL)
+        {
+            long *count = StrMap_get(&defs, fn->ins[i].dest);
+            StrMap_set(&defs, fn->ins[i].dest, count == NULL ? 1 : *count + 1);
+        }
+    }
+
+    struct IlValues vals = { .values = NULL, .size = 0, .allocated = 0, .loads = NULL, .numLoads = 0, .loadsAllocated = 0 };
+    struct IlRenames renames = { .targets = NULL, .size = 0, .allocated = 0 };
+    size_t out = 0;
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        struct IlIns *ins = &fn->ins[i];
+        for (int a = 0; a < ins->numArgs; a++)
+        {
+            IlRenames_apply(&renames, &ins->args[a]);
+        }
+
+        if (ins->op == il_label)
+        {
+            IlValues_clear(&vals);
+        }
+
+        char *key = NULL;
+        if (IlIns_isPure(ins) && !IlIns_readsDest(ins))
+        {
+            key = IlIns_key(ins);
+            struct IlValue *val = IlValues_lookup(&vals, key);
+            if (val != NULL && strcmp(val->value, ins->dest) == 0)
+            {
+                // the destination still holds this very value
+                free(key);
+                IlIns_free(ins);
+                continue;
+            }
+            if (val != NULL)
+            {
+                free(key);
+                key = NULL;
+                if (*StrMap_get(&defs, ins->dest) == 1 && *StrMap_get(&defs, val->value) == 1)
+                {
+                    IlRenames_add(&renames, ins->dest, val->value);
+                    IlIns_free(ins);
+                    continue;
+                }
+
+                for (int a = 0; a < ins->numArgs; a++)
+                {
+                    free(ins->args[a].val);
+                }
+                free(ins->callee);
+                ins->op = il_copy;
+                ins->callee = NULL;
+                ins->numArgs = 1;
+                ins->args[0] = (struct IlArg) { .type = 0, .val = copyString(val->value) };
+            }
+        }
+
+        if (IlIns_writesMemory(ins))
+        {
+            IlValues_clobberLoads(&vals);
+        }
+        if (ins->dest != NULL)
+        {
+            StrMap_set(&vals.gens, ins->dest, IlValues_gen(&vals, ins->dest) + 1);
+        }
+        if (key != NULL)
+        {
+            IlValues_add(&vals, key, ins);
+            free(key);
+        }
+        fn->ins[out++] = *ins;
+    }
+    fn->size = out;
+
+    free(vals.values);
+    free(vals.loads);
+    StrMap_free(&vals.byKey);
+    StrMap_free(&vals.gens);
+    IlRenames_free(&renames);
+    StrMap_free(&defs);
+}
+
+enum PeepholeRule
+{
+    peep_fold,
+    peep_identity,
+    peep_selfCopy,
+    peep_mergeMove,
+    peep_copyForward,
+    peep_unreachable,
+    peep_jumpNext,
+    peep_constBranch,
+    NUM_PEEPHOLE_RULES
+};
+
+static const char *PeepholeRuleNames[] =
+{
+    [peep_fold] = "fold",
+    [peep_identity] = "identity",
+    [peep_selfCopy] = "self-copy",
+    [peep_mergeMove] = "merge-move",
+    [peep_copyForward] = "copy-forward",
+    [peep_unreachable] = "unreachable",
+    [peep_jumpNext] = "jump-next",
+    [peep_constBranch] = "const-branch"
+};
+
+// turns ins into a copy of val, which is copied
+static void IlIns_makeCopy(struct IlIns *ins, const char *val)
+{
+    char *copy = copyString(val);
+    for (int a = 0; a < ins->numArgs; a++)
+    {
+        free(ins->args[a].val);
+    }
+    ins->op = il_copy;
+    ins->numArgs = 1;
+    ins->args[0] = (struct IlArg) { .type = 0, .val = copy };
+}
+
+static bool Peephole_compare(enum IlOp op, int x, int y)
+{
+    switch (op)
+    {
+        case il_ceqw: return x == y;
+        case il_cnew: return x != y;
+        case il_csltw: return x < y;
+        case il_cslew: return x <= y;
+        case il_csgtw: return x > y;
+        default: return x >= y;
+    }
+}
+
+// Folds arithmetic and comparisons on constants and drops adds and muls
+// by 0 or 1.
+static void Peephole_simplify(struct IlIns *ins)
+{
+    if (ins->op != il_add && ins->op != il_sub && ins->op != il_mul && ins->op != il_extsw && !IlOp_isCompare(ins->op))
+    {
+        return;
+    }
+
+    bool constant = true;
+    for (int a = 0; a < ins->numArgs; a++)
+    {
+        constant = constant && Il_isConstant(ins->args[a].val);
+    }
+    if (constant)
+    {
+        // unsigned so overflow wraps like the machine does
+        unsigned long x = strtol(ins->args[0].val, NULL, 10);
+        unsigned long y = ins->numArgs > 1 ? strtol(ins->args[1].val, NULL, 10) : 0;
+        unsigned long r = ins->op == il_add ? x + y : ins->op == il_sub ? x - y : ins->op == il_mul ? x * y : x;
+        if (IlOp_isCompare(ins->op))
+        {
+            r = Peephole_compare(ins->op, (int32_t)x, (int32_t)y);
+        }
+        long value = ins->type == 'w' || ins->op == il_extsw ? (long)(int32_t)r : (long)r;
+        IlIns_makeCopy(ins, Il_num(value).s);
+        Ctx->PeepholeHits[peep_fold]++;
+        return;
+    }
+
+    if (ins->op == il_extsw || IlOp_isCompare(ins->op))
+    {
+        return;
+    }
+    char *left = ins->args[0].val;
+    char *right = ins->args[1].val;
+    long unit = ins->op == il_mul ? 1 : 0;
+    if (Il_isConstant(right) && strtol(right, NULL, 10) == unit)
+    {
+        IlIns_makeCopy(ins, left);
+    } else if (ins->op != il_sub && Il_isConstant(left) && strtol(left, NULL, 10) == unit)
+    {
+        IlIns_makeCopy(ins, right);
+    } else if (ins->op == il_mul && ((Il_isConstant(right) && strtol(right, NULL, 10) == 0)
+                                  || (Il_isConstant(left) && strtol(left, NULL, 10) == 0)))
+    {
+        IlIns_makeCopy(ins, "0");
+    } else
+    {
+        return;
+    }
+    Ctx->PeepholeHits[peep_identity]++;
+}
+
+// Cleans up the naive sequences Exp_toIL emits, looking at each
+// instruction and the one emitted before it. Constant arithmetic is
+// folded, a copy of a single-use temporary computed just before is merged
+// into that instruction, and copies of constants, globals and values that
+// never change are forwarded into their uses. A jnz on a constant becomes
+// a jmp. Code after a ret or jmp up to the next label, and jumps to the
+// label that follows, are dropped.
+// Names read before their definition (parameters, values carried around
+// a loop) keep their definitions.
+static void Il_peephole(struct IlFunction *fn)
+{
+    struct StrMap defs = { .entries = NULL, .size = 0, .allocated = 0 };
+    struct StrMap uses = { .entries = NULL, .size = 0, .allocated = 0 };
+    struct StrMap liveIn = { .entries = NULL, .size = 0, .allocated = 0 };
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        struct IlIns *ins = &fn->ins[i];
+        for (int a = 0; a < ins->numArgs; a++)
+        {
+            char *arg = ins->args[a].val;
+            if (arg[0] != '%')
+            {
+                continue;
+            }
+            long *count = StrMap_get(&uses, arg);
+            StrMap_set(&uses, arg, count == NULL ? 1 : *count + 1);
+            if (StrMap_get(&defs, arg) == NULL)
+            {
+                StrMap_set(&liveIn, arg, 1);
+            }
+        }
+        if (ins->dest != NULL)
+        {
+            long *count = StrMap_get(&defs, ins->dest);
+            StrMap_set(&defs, ins->dest, count == NULL ? 1 : *count + 1);
+        }
+    }
+
+    struct StrMap defined = { .entries = NULL, .size = 0, .allocated = 0 };
+    struct IlRenames renames = { .targets = NULL, .size = 0, .allocated = 0 };
+    bool reachable = true;
+    size_t out = 0;
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        struct IlIns *ins = &fn->ins[i];
+        if (ins->op == il_label)
+        {
+            reachable = true;
+            if (out > 0 && fn->ins[out - 1].op == il_jmp && strcmp(fn->ins[out - 1].args[0].val, ins->args[0].val) == 0)
+            {
+                IlIns_free(&fn->ins[--out]);
+                Ctx->PeepholeHits[peep_jumpNext]++;
+            }
+        }
+        if (!reachable)
+        {
+            IlIns_free(ins);
+            Ctx->PeepholeHits[peep_unreachable]++;
+            continue;
+        }
+
+        for (int a = 0; a < ins->numArgs; a++)
+        {
+            IlRenames_apply(&renames, &ins->args[a]);
+        }
+        Peephole_simplify(ins);
+
+        if (ins->op == il_jnz && Il_isConstant(ins->args[0].val))
+        {
+            int taken = strtol(ins->args[0].val, NULL, 10) != 0 ? 1 : 2;
+            free(ins->args[0].val);
+            free(ins->args[3 - taken].val);
+            ins->args[0].val = ins->args[taken].val;
+            ins->op = il_jmp;
+            ins->numArgs = 1;
+            Ctx->PeepholeHits[peep_constBranch]++;
+        }
+
+        if (ins->op == il_copy)
+        {
+            char *dest = ins->dest;
+            char *val = ins->args[0].val;
+            struct IlIns *prev = out > 0 ? &fn->ins[out - 1] : NULL;
+            if (strcmp(dest, val) == 0)
+            {
+                IlIns_free(ins);
+                Ctx->PeepholeHits[peep_selfCopy]++;
+                continue;
+            }
+
+            if (prev != NULL && prev->dest != NULL && strcmp(prev->dest, val) == 0 && prev->type == ins->type
+                && *StrMap_get(&defs, val) == 1 && *StrMap_get(&uses, val) == 1 && StrMap_get(&liveIn, val) == NULL)
+            {
+                free(prev->dest);
+                prev->dest = copyString(dest);
+                StrMap_set(&defined, dest, 1);
+                IlIns_free(ins);
+                Ctx->PeepholeHits[peep_mergeMove]++;
+                continue;
+            }
+
+            // a temporary source must keep its value for as long as dest does
+            long *valDefs = StrMap_get(&defs, val);
+            bool stable = val[0] != '%' || valDefs == NULL
+                       || (*valDefs == 1 && StrMap_get(&defined, val) != NULL && StrMap_get(&liveIn, val) == NULL);
+            if (stable && *StrMap_get(&defs, dest) == 1 && StrMap_get(&liveIn, dest) == NULL)
+            {
+                if (val[0] == '%')
+                {
+                    long *valUses = StrMap_get(&uses, val);
+                    long *destUses = StrMap_get(&uses, dest);
+                    StrMap_set(&uses, val, (valUses == NULL ? 0 : *valUses) + (destUses == NULL ? 0 : *destUses));
+                }
+                IlRenames_add(&renames, dest, val);
+                IlIns_free(ins);
+                Ctx->PeepholeHits[peep_copyForward]++;
+                continue;
+            }
+        }
+
+        if (ins->dest != NULL)
+        {
+            StrMap_set(&defined, ins->dest, 1);
+        }
+        if (ins->op == il_ret || ins->op == il_jmp)
+        {
+            reachable = false;
+        }
+        fn->ins[out++] = *ins;
+    }
+    fn->size = out;
+
+    IlRenames_free(&renames);
+    StrMap_free(&defined);
+    StrMap_free(&liveIn);
+    StrMap_free(&uses);
+    StrMap_free(&defs);
+}
+
+// Drops bounds checks that cannot fail: constant indices below the
+// length, indices whose only definition copies such a constant, and
+// repeats of a check on an index against a length no smaller, with no
+// label or redefinition of the index in between. As in Il_peephole,
+// names read before their definition (parameters, values carried around
+// a self tail call) are never constant.
+static void Il_elimChecks(struct IlFunction *fn)
+{
+    struct StrMap defs = { .entries = NULL, .size = 0, .allocated = 0 };
+    struct StrMap liveIn = { .entries = NULL, .size = 0, .allocated = 0 };
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        for (int a = 0; a < fn->ins[i].numArgs; a++)
+        {
+            char *arg = fn->ins[i].args[a].val;
+            if (arg[0] == '%' && StrMap_get(&defs, arg) == NULL)
+            {
+                StrMap_set(&liveIn, arg, 1);
+            }
+        }
+        if (fn->ins[i].dest != NULL)
+        {
+            long *count = StrMap_get(&defs, fn->ins[i].dest);
+            StrMap_set(&defs, fn->ins[i].dest, count == NULL ? 1 : *count + 1);
+        }
+    }
+
+    struct StrMap constants = { .entries = NULL, .size = 0, .allocated = 0 };
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        struct IlIns *ins = &fn->ins[i];
+        if (ins->op == il_copy && *StrMap_get(&defs, ins->dest) == 1 && StrMap_get(&liveIn, ins->dest) == NULL
+            && Il_isConstant(ins->args[0].val))
+        {
+            StrMap_set(&constants, ins->dest, strtol(ins->args[0].val, NULL, 10));
+        }
+    }
+
+    // index -> smallest length it was checked against, LONG_MAX once stale
+    struct StrMap checked = { .entries = NULL, .size = 0, .allocated = 0 };
+    size_t out = 0;
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        struct IlIns *ins = &fn->ins[i];
+        if (ins->op == il_label)
+        {
+            StrMap_free(&checked);
+        }
+
+        if (ins->op == il_check)
+        {
+            char *index = ins->args[0].val;
+            long length = strtol(ins->args[1].val, NULL, 10);
+            long *constant = StrMap_get(&constants, index);
+            long value = Il_isConstant(index) ? strtol(index, NULL, 10) : constant != NULL ? *constant : -1;
+            long *prev = StrMap_get(&checked, index);
+            if ((value >= 0 && value < length) || (prev != NULL && *prev <= length))
+            {
+                IlIns_free(ins);
+                continue;
+            }
+            StrMap_set(&checked, index, length);
+        }
+
+        if (ins->dest != NULL && StrMap_get(&checked, ins->dest) != NULL)
+        {
+            StrMap_set(&checked, ins->dest, LONG_MAX);
+        }
+        fn->ins[out++] = *ins;
+    }
+    fn->size = out;
+
+    StrMap_free(&checked);
+    StrMap_free(&constants);
+    StrMap_free(&liveIn);
+    StrMap_free(&defs);
+}
+
+typedef struct IlCallCount
+{
+    char *callee;
+    size_t count;
+} IlCallCount;
+
+typedef struct IlCallCounts
+{
+    struct IlCallCount *counts;
+    size_t size;
+    size_t allocated;
+} IlCallCounts;
+
+typedef struct IlStats
+{
+    size_t functions;
+    size_t instructions;
+    size_t temporaries;
+    size_t dataDefs;
+    size_t dataBytes;
+    struct IlCallCounts calls;
+} IlStats;
+
+static void IlCallCounts_add(struct IlCallCounts *calls, char *callee, size_t count)
+{
+    for (size_t i = 0; i < calls->size; i++)
+    {
+        if (strcmp(calls->counts[i].callee, callee) == 0)
+        {
+            calls->counts[i].count += count;
+            return;
+        }
+    }
+
+    struct IlCallCount call = { .callee = copyString(callee), .count = count };
+    VEC_PUSH(calls->counts, calls->size, calls->allocated, call);
+}
+
+static int IlCallCount_compare(const void *a, const void *b)
+{
+    return strcmp(((const struct IlCallCount *)a)->callee, ((const struct IlCallCount *)b)->callee);
+}
+
+static void IlCallCounts_print(struct IlCallCounts *calls, FILE *out)
+{
+    qsort(calls->counts, calls->size, sizeof(struct IlCallCount), IlCallCount_compare);
+    for (size_t i = 0; i < calls->size; i++)
+    {
+        fprintf(out, "    calls %s %zu\n", calls->counts[i].callee, calls->counts[i].count);
+    }
+}
+
+static void IlCallCounts_free(struct IlCallCounts *calls)
+{
+    for (size_t i = 0; i < calls->size; i++)
+    {
+        free(calls->counts[i].callee);
+    }
+    free(calls->counts);
+    *calls = (struct IlCallCounts) { .counts = NULL, .size = 0, .allocated = 0 };
+}
+
+static int compareStrings(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Prints the metrics of one lowered function and adds them to the totals.
+static void IlStats_function(struct IlFunction *fn, FILE *out)
+{
+    size_t instructions = 0;
+    struct IlCallCounts calls = { .counts = NULL, .size = 0, .allocated = 0 };
+    char **dests = malloc(sizeof(char *) * (fn->size + 1));
+    size_t numDests = 0;
+    if (dests == NULL)
+    {
+        compileError("error allocating memory");
+    }
+
+    for (size_t i = 0; i < fn->size; i++)
+    {
+        struct IlIns *ins = &fn->ins[i];
+        if (ins->op == il_label || ins->op == il_dbgloc)
+        {
+            continue;
+        }
+        instructions++;
+        if (ins->dest != NULL)
+        {
+            dests[numDests++] = ins->dest;
+        }
+        if (ins->op == il_call)
+        {
+            IlCallCounts_add(&calls, ins->callee, 1);
+        }
+    }
+
+    qsort(dests, numDests, sizeof(char *), compareStrings);
+    size_t temporaries = 0;
+    for (size_t i = 0; i < numDests; i++)
+    {
+        if (i == 0 || strcmp(dests[i - 1], dests[i]) != 0)
+        {
+            temporaries++;
+        }
+    }
+    free(dests);
+
+    fprintf(out, "function $%s\n", fn->name);
+    fprintf(out, "    instructions %zu\n", instructions);
+    fprintf(out, "    temporaries %zu\n", temporaries);
+    IlCallCounts_print(&calls, out);
+
+    Ctx->ilStats->functions++;
+    Ctx->ilStats->instructions += instructions;
+    Ctx->ilStats->temporaries += temporaries;
+    for (size_t i = 0; i < calls.size; i++)
+    {
+        IlCallCounts_add(&Ctx->ilStats->calls, calls.counts[i].callee, calls.counts[i].count);
+    }
+    IlCallCounts_free(&calls);
+}
+
+static void IlStats_data(size_t bytes)
+{
+    Ctx->ilStats->dataDefs++;
+    Ctx->ilStats->dataBytes += bytes;
+}
+
+static void IlStats_report(FILE *out)
+{
+    fprintf(out, "module\n");
+    fprintf(out, "    functions %zu\n", Ctx->ilStats->functions);
+    fprintf(out, "    instructions %zu\n", Ctx->ilStats->instructions);
+    fprintf(out, "    temporaries %zu\n", Ctx->ilStats->temporaries);
+    fprintf(out, "    data %zu\n", Ctx->ilStats->dataDefs);
+    fprintf(out, "    data bytes %zu\n", Ctx->ilStats->dataBytes);
+    IlCallCounts_print(&Ctx->ilStats->calls, out);
+    IlCallCounts_free(&Ctx->ilStats->calls);
+    for (int i = 0; i < NUM_PEEPHOLE_RULES; i++)
+    {
+        fprintf(out, "    peephole %s %zu\n", PeepholeRuleNames[i], Ctx->PeepholeHits[i]);
+    }
+}
+
+// Temporaries are %.vN, numbered per function. Variable names cannot
+// contain a '.', so the two never collide.
+static char *newTemp()
+{
+    int len = snprintf(NULL, 0, "%%.%c%d", var, Ctx->CurFn->numTemps + 1) + 1;
+    char *temp = malloc(sizeof(char) * len);
+    if (temp == NULL)
+    {
+        compileError("error allocating memory");
+    }
+    snprintf(temp, len, "%%.%c%d", var, ++Ctx->CurFn->numTemps);
+    return temp;
+}
+
+// --profile-use: call counts per source function name, as written by
+// --instrument ("name calls [time]" per line)
+typedef struct Profile
+{
+    bool loaded;
+    struct StrMap counts;
+    long maxCount;
+    struct StrMap inlinable;    // name -> ExpId, see Profile_findInlinable
+} Profile;
+
+static void Profile_load(const char *path)
+{
+    char *text = readFile(path, NULL);
+    if (text == NULL)
+    {
+        compileError("profile not found.");
+    }
+
+    Ctx->profile->loaded = true;
+    Ctx->profile->maxCount = 0;
+    char *line = text;
+    while (*line != '\0')
+    {
+        char *end = strchr(line, '\n');
+        if (end != NULL)
+        {
+            *end = '\0';
+        }
+
+        char *name = line;
+        while (isspace((unsigned char)*name))
+        {
+            name++;
+        }
+        // runtime counters are written as # comments
+        if (*name == '#')
+        {
+            *name = '\0';
+        }
+        char *nameEnd = name;
+        while (*nameEnd != '\0' && !isspace((unsigned char)*nameEnd))
+        {
+            nameEnd++;
+        }
+
+        if (nameEnd != name && *nameEnd != '\0')
+        {
+            char *rest = nameEnd + 1;
+            *nameEnd = '\0';
+            long count = strtol(rest, NULL, 10);
+            long *existing = StrMap_get(&Ctx->profile->counts, name);
+            if (existing != NULL)
+            {
+                count += *existing;
+            }
+            StrMap_set(&Ctx->profile->counts, name, count);
+            if (count > Ctx->profile->maxCount)
+            {
+                Ctx->profile->maxCount = count;
+            }
+        }
+
+        if (end == NULL)
+        {
+            break;
+        }
+        line = end + 1;
+    }
+    free(text);
+}
+
+static long Profile_count(char *name)
+{
+    long *count = StrMap_get(&Ctx->profile->counts, name);
+    return count == NULL ? 0 : *count;
+}
+
+// Functions that ran at least 1% as often as the hottest one go to
+// .text.hot, functions that never ran to .text.unlikely, where the linker
+// groups them across objects.
+static char *Profile_section(char *name)
+{
+    if (!Ctx->profile->loaded)
+    {
+        return NULL;
+    }
+
+    long count = Profile_count(name);
+    if (count == 0)
+    {
+        return ".text.unlikely";
+    }
+    if (count * 100 >= Ctx->profile->maxCount)
+    {
+        return ".text.hot";
+    }
+    return NULL;
+}
+
+// nodes in the returned value of a function that is inlined
+#define INLINE_MAX_NODES 8
+
+// Whether the value is small enough to inline and calls no user function,
+// so inlining never nests and cannot recurse
+static bool Profile_smallValue(ExpId value)
+{
+    ExpId stack[INLINE_MAX_NODES];
+    size_t size = 0;
+    size_t nodes = 0;
+    stack[size++] = value;
+    while (size > 0)
+    {
+        ExpId exp = stack[--size];
+        if (++nodes > INLINE_MAX_NODES)
+        {
+            return false;
+        }
+        ExpId left = EXP_NONE;
+        ExpId right = EXP_NONE;
+        switch (EXP_TAG(exp))
+        {
+            case exp_int:
+            case exp_var:
+            case exp_stringlit:
+                break;
+            case exp_add:
+                left = EXP_ADD(exp)->left;
+                right = EXP_ADD(exp)->right;
+                break;
+            case exp_compare:
+                left = EXP_COMPARE(exp)->left;
+                right = EXP_COMPARE(exp)->right;
+                break;
+            case exp_call:
+                if (strcmp(EXP_CALL(exp)->callee, "toString") != 0)
+                {
+                    return false;
+                }
+                left = EXP_CHILD(EXP_CALL(exp)->args, 0);
+                break;
+            default:
+                return false;
+        }
+        // a node has at most two children, and nodes past the limit are
+        // never visited, so the stack cannot outgrow it
+        if (right != EXP_NONE && size < INLINE_MAX_NODES)
+        {
+            stack[size++] = right;
+        }
+        if (left != EXP_NONE && size < INLINE_MAX_NODES)
+        {
+            stack[size++] = left;
+        }
+    }
+    return true;
+}
+
+// With a profile, hot functions (as for .text.hot) whose body is a single
+// small `return value;` are inlined into their callers. They are still
+// emitted, for calls from other modules.
+static void Profile_findInlinable()
+{
+    if (!Ctx->profile->loaded)
+    {
+        return;
+    }
+    for (int i = 0; i < Ctx->ExpCount; i++)
+    {
+        ExpId exp = Ctx->Expressions[i];
+        if (EXP_TAG(exp) != exp_function)
+        {
+            continue;
+        }
+        struct ExpFunction *fn = EXP_FUNCTION(exp);
+        long count = Profile_count(fn->name);
+        if (count == 0 || count * 100 < Ctx->profile->maxCount || fn->numExprs != 1 || strcmp(fn->name, "entry") == 0)
+        {
+            continue;
+        }
+        ExpId stmt = EXP_CHILD(fn->body, 0);
+        if (EXP_TAG(stmt) == exp_return && EXP_RETURN(stmt) != EXP_NONE && Profile_smallValue(EXP_RETURN(stmt)))
+        {
+            StrMap_set(&Ctx->profile->inlinable, fn->name, exp);
+        }
+    }
+}
+
+typedef struct ProfiledFunctions
+{
+    char **names;
+    size_t size;
+    size_t allocated;
+} ProfiledFunctions;
+
+static void Il_push(struct IlIns ins)
+{
+    struct IlIns *slot = Il_append(il_label, 0, NULL, 0);
+    *slot = ins;
+}
+
+static void Il_profileExit(char *slot, char *start)
+{
+    char *end = newTemp();
+    char *elapsed = newTemp();
+    char *time = newTemp();
+    char *total = newTemp();
+    Il_call('l', end, "$prof_clock", 0);
+    Il_emit(il_sub, 'l', elapsed, 2, end, start);
+    Il_emit(il_add, 'l', time, 2, slot, "8");
+    Il_emit(il_loadl, 'l', total, 1, time);
+    Il_emit(il_add, 'l', total, 2, total, elapsed);
+    Il_emit(il_storel, 0, NULL, 2, total, time);
+    free(end);
+    free(elapsed);
+    free(time);
+    free(total);
+}
+
+// Adds a call counter and inclusive time to the function's profile slot
+// { l calls, l nanoseconds }: the count is bumped and a timestamp taken
+// after @start, the elapsed time added in front of every ret. The entry
+// function also registers the profile table, dumped at exit.
+static void Il_instrument(struct IlFunction *fn, char *sourceName, bool entry)
+{
+    int len = snprintf(NULL, 0, "$__prof_%s", fn->name) + 1;
+    char *slot = malloc(len);
+    snprintf(slot, len, "$__prof_%s", fn->name);
+
+    struct IlIns *old = fn->ins;
+    size_t size = fn->size;
+    *fn = (struct IlFunction) { .name = fn->name, .exported = fn->exported, .retType = fn->retType, .params = fn->params, .numParams = fn->numParams, .section = fn->section, .numTemps = fn->numTemps };
+
+    char *start = newTemp();
+    char *count = newTemp();
+    bool first = true;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (old[i].op == il_ret)
+        {
+            Il_profileExit(slot, start);
+        }
+
+        Il_push(old[i]);
+
+        if (first && old[i].op == il_label)
+        {
+            first = false;
+            if (entry)
+            {
+                Il_call(0, NULL, "$prof_init", 1, 'l', "$__prof_table");
+            }
+            Il_emit(il_loadl, 'l', count, 1, slot);
+            Il_emit(il_add, 'l', count, 2, count, "1");
+            Il_emit(il_storel, 0, NULL, 2, count, slot);
+            Il_call('l', start, "$prof_clock", 0);
+        }
+    }
+    free(old);
+    free(start);
+    free(count);
+
+    VEC_PUSH(Ctx->profiled->names, Ctx->profiled->size, Ctx->profiled->allocated, copyString(fn->name));
+
+    char nameSym[strlen(fn->name) + sizeof("__prof_name_")];
+    snprintf(nameSym, sizeof(nameSym), "__prof_name_%s", fn->name);
+    struct DataWriter data = Data_begin(Ctx->CodeOut, nameSym);
+    Data_string(&data, sourceName);
+    Data_byte(&data, 0);
+    Data_end(&data);
+
+    data = Data_begin(Ctx->CodeOut, slot + 1);
+    Data_long(&data, 0);
+    Data_long(&data, 0);
+    Data_end(&data);
+    free(slot);
+}
+
+// { l name, l slot } pairs terminated by a 0 name, read by prof_init
+static void Il_printProfileTable()
+{
+    struct DataWriter data = Data_begin(Ctx->out, "__prof_table");
+    for (size_t i = 0; i < Ctx->profiled->size; i++)
+    {
+        char sym[strlen(Ctx->profiled->names[i]) + sizeof("__prof_name_")];
+        snprintf(sym, sizeof(sym), "__prof_name_%s", Ctx->profiled->names[i]);
+        Data_symbol(&data, sym);
+        snprintf(sym, sizeof(sym), "__prof_%s", Ctx->profiled->names[i]);
+        Data_symbol(&data, sym);
+    }
+    Data_long(&data, 0);
+    Data_end(&data);
+}
+char *Exp_getType(ExpId exp);
+char * Exp_prepare(ExpId exp);
+void Exp_toIL(ExpId exp);
+char *getQbeType(char *type);
+
+// Arrays up to this many bytes live on the stack, larger ones on the heap
+#define ARRAY_STACK_MAX 16384
+
+// N for an int[N] type, -1 for any other type
+static long arrayLength(const char *type)
+{
+    if (strncmp(type, "int[", 4) != 0)
+    {
+        return -1;
+    }
+    return strtol(type + 4, NULL, 10);
+}
+
+// Reserves the storage of an int array for the current call and returns
+// its operand. Arrays too large for the stack come from array_alloc, so
+// recursive calls and concurrent compilations still get their own.
+static char *Exp_allocArray(long length)
+{
+    long size = length * 4;
+    char *storage = newTemp();
+    if (size <= ARRAY_STACK_MAX)
+    {
+        Il_emit(il_alloc4, 'l', storage, 1, Il_num(size).s);
+        return storage;
+    }
+
+    struct IlFunction *fn = Ctx->CurFn;
+    Il_call('l', storage, "$array_alloc", 1, 'l', Il_num(size).s);
+    VEC_PUSH(fn->heapArrays, fn->numHeapArrays, fn->heapArraysAllocated, storage);
+    return storage;
+}
+
+// ret, after freeing the arrays on the heap. value is NULL in a function
+// without a result.
+static void Il_return(const char *value)
+{
+    struct IlFunction *fn = Ctx->CurFn;
+    for (size_t i = 0; i < fn->numHeapArrays; i++)
+    {
+        Il_call(0, NULL, "$free", 1, 'l', fn->heapArrays[i]);
+    }
+    Il_emit(il_ret, 0, NULL, value != NULL ? 1 : 0, value);
+}
+
+// Allocates every array declared in the list or in the blocks of its ifs.
+// They are visited in source order, the order Exp_toIL lowers them in.
+static void Exp_allocArrays(uint32_t list, uint32_t count)
+{
+    struct IlFunction *fn = Ctx->CurFn;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        ExpId stmt = EXP_CHILD(list, i);
+        if (EXP_TAG(stmt) == exp_declaration && arrayLength(EXP_DECLARATION(stmt)->type) >= 0)
+        {
+            char *storage = Exp_allocArray(arrayLength(EXP_DECLARATION(stmt)->type));
+            VEC_PUSH(fn->arrays, fn->numArrays, fn->arraysAllocated, storage);
+        } else if (EXP_TAG(stmt) == exp_if)
+        {
+            struct ExpIf *branch = EXP_IF(stmt);
+            Exp_allocArrays(branch->then, branch->numThen);
+            Exp_allocArrays(branch->otherwise, branch->numOtherwise);
+        }
+    }
+}
+
+// Points %name at the next array's storage and zeroes it, each time the
+// declaration runs
+static void Exp_declareArray(char *name, long length)
+{
+    char target[strlen(name) + 2];
+    snprintf(target, sizeof(target), "%%%s", name);
+    struct IlFunction *fn = Ctx->CurFn;
+    Il_emit(il_copy, 'l', target, 1, fn->arrays[fn->nextArray++]);
+    Il_call(0, NULL, "$memset", 3, 'l', target, 'w', "0", 'l', Il_num(length * 4).s);
+}
+
+// Returns the address of an array element, after its bounds check
+static char *Exp_prepareElement(ExpId exp)
+{
+    Exp_getType(exp); // rejects bad indexing before any code is emitted
+    struct ExpIndex element = *EXP_INDEX(exp);
+    long length = arrayLength(Exp_getType(element.array));
+    char *base = Exp_prepare(element.array);
+    char *index = Exp_prepare(element.index);
+    Il_check(index, length);
+
+    char *addr = newTemp();
+    if (EXP_TAG(element.index) == exp_int)
+    {
+        Il_emit(il_add, 'l', addr, 2, base, Il_num(EXP_INT(element.index) * 4L).s);
+    } else
+    {
+        char *wide = newTemp();
+        char *offset = newTemp();
+        Il_emit(il_extsw, 'l', wide, 1, index);
+        Il_emit(il_mul, 'l', offset, 2, wide, "4");
+        Il_emit(il_add, 'l', addr, 2, base, offset);
+        free(wide);
+        free(offset);
+    }
+    free(base);
+    free(index);
+    return addr;
+}
+
+// the parser may be growing stringLiterals on another thread
+static size_t literalLength(int id)
+{
+    pthread_mutex_lock(&Ctx->literalsLock);
+    size_t len = Ctx->stringLiterals[id].length;
+    pthread_mutex_unlock(&Ctx->literalsLock);
+    return len;
+}
+
+// Appends the operands of the tree of additions under exp, left to
+// right. The walk keeps its own stack, so a chain of any length or depth
+// costs no C stack.
+static void Exp_collectTerms(ExpId exp, ExpId **terms, size_t *size, size_t *allocated)
+{
+    ExpId *stack = NULL;
+    size_t depth = 0;
+    size_t stackAllocated = 0;
+    VEC_PUSH(stack, depth, stackAllocated, exp);
+    while (depth > 0)
+    {
+        ExpId top = stack[--depth];
+        if (EXP_TAG(top) != exp_add)
+        {
+            VEC_PUSH(*terms, *size, *allocated, top);
+            continue;
+        }
+        // the left operand is popped, and so collected, first
+        VEC_PUSH(stack, depth, stackAllocated, EXP_ADD(top)->right);
+        VEC_PUSH(stack, depth, stackAllocated, EXP_ADD(top)->left);
+    }
+    free(stack);
+}
+
+// Lowers a tree of int additions in the post order recursion would use,
+// on an explicit stack. Operands other than additions go to Exp_prepare.
+static char *Exp_prepareSum(ExpId exp)
+{
+    struct SumStep { ExpId exp; bool expanded; } *steps = NULL;
+    size_t numSteps = 0;
+    size_t stepsAllocated = 0;
+    char **values = NULL;
+    size_t numValues = 0;
+    size_t valuesAllocated = 0;
+    VEC_PUSH(steps, numSteps, stepsAllocated, ((struct SumStep) { exp, false }));
+    while (numSteps > 0)
+    {
+        struct SumStep step = steps[--numSteps];
+        if (EXP_TAG(step.exp) != exp_add)
+        {
+            VEC_PUSH(values, numValues, valuesAllocated, Exp_prepare(step.exp));
+            continue;
+        }
+        if (!step.expanded)
+        {
+            VEC_PUSH(steps, numSteps, stepsAllocated, ((struct SumStep) { step.exp, true }));
+            VEC_PUSH(steps, numSteps, stepsAllocated, ((struct SumStep) { EXP_ADD(step.exp)->right, false }));
+            VEC_PUSH(steps, numSteps, stepsAllocated, ((struct SumStep) { EXP_ADD(step.exp)->left, false }));
+            continue;
+        }
+
+        char *right = values[--numValues];
+        char *left = values[--numValues];
+        char *finalVar = newTemp();
+        Il_emit(il_add, 'w', finalVar, 2, left, right);
+        free(left);
+        free(right);
+        values[numValues++] = finalVar;
+    }
+
+    char *result = values[0];
+    free(steps);
+    free(values);
+    return result;
+}
+
+// Lowers a chain of string + string into one arena allocation sized for
+// the whole result, followed by a copy of each piece. Literal lengths are
+// folded at compile time, the others are read from the length prefix.
+static char *Exp_prepareConcat(ExpId exp)
+{
+    ExpId *pieces = NULL;
+    size_t size = 0;
+    size_t allocated = 0;
+    Exp_collectTerms(exp, &pieces, &size, &allocated);
+
+    char **vals = malloc(sizeof(char *) * size);
+    char **lens = malloc(sizeof(char *) * size);
+    if (vals == NULL || lens == NULL)
+    {
+        compileError("error allocating memory");
+    }
+
+    size_t constLen = 0;
+    char *total = NULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        vals[i] = Exp_prepare(pieces[i]);
+        if (EXP_TAG(pieces[i]) == exp_stringlit)
+        {
+            size_t len = literalLength(EXP_STRINGLIT(pieces[i]));
+            int n = snprintf(NULL, 0, "%zu", len) + 1;
+            lens[i] = malloc(sizeof(char) * n);
+            snprintf(lens[i], n, "%zu", len);
+            constLen += len;
+            continue;
+        }
+
+        lens[i] = newTemp();
+        Il_emit(il_loadl, 'l', lens[i], 1, vals[i]);
+        Il_markInvariant();
+        if (total == NULL)
+        {
+            total = newTemp();
+            Il_emit(il_copy, 'l', total, 1, lens[i]);
+        } else
+        {
+            Il_emit(il_add, 'l', total, 2, total, lens[i]);
+        }
+    }
+
+    char *block = newTemp();
+    if (total == NULL)
+    {
+        Il_call('l', block, "$arena_alloc", 1, 'l', Il_num(constLen + 8).s);
+        Il_emit(il_storel, 0, NULL, 2, Il_num(constLen).s, block);
+    } else
+    {
+        if (constLen > 0)
+        {
+            Il_emit(il_add, 'l', total, 2, total, Il_num(constLen).s);
+        }
+        char *size = newTemp();
+        Il_emit(il_add, 'l', size, 2, total, "8");
+        Il_call('l', block, "$arena_alloc", 1, 'l', size);
+        Il_emit(il_storel, 0, NULL, 2, total, block);
+        free(size);
+    }
+
+    char *dst = newTemp();
+    char *src = newTemp();
+    Il_emit(il_add, 'l', dst, 2, block, "8");
+    for (size_t i = 0; i < size; i++)
+    {
+        Il_emit(il_add, 'l', src, 2, vals[i], "8");
+        Il_call(0, NULL, "$memcpy", 3, 'l', dst, 'l', src, 'l', lens[i]);
+        if (i + 1 < size)
+        {
+            Il_emit(il_add, 'l', dst, 2, dst, lens[i]);
+        }
+        free(vals[i]);
+        free(lens[i]);
+    }
+
+    free(dst);
+    free(src);
+    free(total);
+    free(vals);
+    free(lens);
+    free(pieces);
+    return block;
+}
+
+// Calls a user function, returning the temporary holding its result or
+// NULL when the result is not wanted. Arguments are evaluated left to
+// right and passed with their QBE types.
+// Lowers the returned value of an inlinable function in place of a call
+// to it, with the parameters bound to the argument operands. The value
+// has no side effects, so it is skipped when the result is unused.
+static char *Exp_inlineCall(ExpId function, struct IlArg *args, uint32_t numArgs, bool wantResult)
+{
+    char **vals = malloc(sizeof(char *) * (numArgs + 1));
+    if (vals == NULL)
+    {
+        compileError("error allocating memory");
+    }
+    for (uint32_t i = 0; i < numArgs; i++)
+    {
+        vals[i] = args[i].val;
+    }
+
+    char *result = NULL;
+    if (wantResult)
+    {
+        Ctx->inlining = function;
+        Ctx->inlineArgs = vals;
+        result = Exp_prepare(EXP_RETURN(EXP_CHILD(EXP_FUNCTION(function)->body, 0)));
+        Ctx->inlineArgs = NULL;
+    }
+    for (uint32_t i = 0; i < numArgs; i++)
+    {
+        free(vals[i]);
+    }
+    free(vals);
+    free(args);
+    return result;
+}
+
+static char *Exp_prepareCall(ExpId exp, bool wantResult)
+{
+    struct ExpCall call = *EXP_CALL(exp);
+    struct IlArg *args = malloc(sizeof(struct IlArg) * (call.numArgs + 1));
+    if (args == NULL)
+    {
+        compileError("error allocating memory");
+    }
+    for (uint32_t i = 0; i < call.numArgs; i++)
+    {
+        ExpId arg = EXP_CHILD(call.args, i);
+        args[i].type = *getQbeType(Exp_getType(arg));
+        args[i].val = Exp_prepare(arg);
+    }
+
+    long *inlinable = StrMap_get(&Ctx->profile->inlinable, call.callee);
+    if (inlinable != NULL)
+    {
+        return Exp_inlineCall(*inlinable, args, call.numArgs, wantResult);
+    }
+
+    // Exp_getType rejects using a call without a result as a value
+    char type = wantResult ? *getQbeType(Exp_getType(exp)) : 0;
+    char *result = wantResult ? newTemp() : NULL;
+    struct IlIns *ins = Il_append(il_call, type, result, call.numArgs);
+    int len = strlen(call.callee) + 2;
+    ins->callee = malloc(len);
+    snprintf(ins->callee, len, "$%s", call.callee);
+    if (call.numArgs > 0)
+    {
+        memcpy(ins->args, args, sizeof(struct IlArg) * call.numArgs);
+    }
+    free(args);
+    return result;
+}
+
+// Returns the QBE operand holding the value of exp, emitting whatever
+// instructions are needed to compute it first.
+char * Exp_prepare(ExpId exp)
+{
+    if (EXP_TAG(exp) == exp_call)
+    {
+        struct ExpCall *call = EXP_CALL(exp);
+        if (strcmp(call->callee, "toString") == 0)
+        {
+            char *arg = Exp_prepare(EXP_CHILD(call->args, 0));
+            char *finalVar = newTemp();
+
+            Il_call('l', finalVar, "$itos", 1, 'w', arg);
+
+            free(arg);
+            return finalVar;
+        }
+        if (!isBuiltin(call->callee))
+        {
+            return Exp_prepareCall(exp, true);
+        }
+    } else if(EXP_TAG(exp) == exp_var)
+    {
+        char *varName = EXP_VAR(exp)->name;
+        if (Ctx->inlineArgs != NULL)
+        {
+            // an inlined value can only name the parameters
+            struct ExpFunction *fn = EXP_FUNCTION(Ctx->inlining);
+            for (uint32_t i = 0; i < fn->numParams; i++)
+            {
+                if (strcmp(Nodes->params.items[fn->params + i].name, varName) == 0)
+                {
+                    return copyString(Ctx->inlineArgs[i]);
+                }
+            }
+        }
+        int len = strlen(varName) + 2;
+        char *finalVar = malloc(sizeof(char) * len);
+        snprintf(finalVar, len, "%%%s", varName);
+        return finalVar;
+    } else if (EXP_TAG(exp) == exp_stringlit)
+    {
+        int len = snprintf(NULL, 0, "$sl%d", EXP_STRINGLIT(exp)) + 1;
+        char *finalVar = malloc(sizeof(char) * len);
+        snprintf(finalVar, len, "$sl%d", EXP_STRINGLIT(exp));
+        return finalVar;
+    } else if (EXP_TAG(exp) == exp_index)
+    {
+        char *addr = Exp_prepareElement(exp);
+        char *finalVar = newTemp();
+        Il_emit(il_loadw, 'w', finalVar, 1, addr);
+        free(addr);
+        return finalVar;
+    } else if (EXP_TAG(exp) == exp_int)
+    {
+        int len = snprintf(NULL, 0, "%d", EXP_INT(exp)) + 1;
+        char *finalVar = malloc(sizeof(char) * len);
+        snprintf(finalVar, len, "%d", EXP_INT(exp));
+        return finalVar;
+    } else if (EXP_TAG(exp) == exp_add)
+    {
+        if (strcmp(Exp_getType(exp), "string") == 0)
+        {
+            return Exp_prepareConcat(exp);
+        }
+        return Exp_prepareSum(exp);
+    } else if (EXP_TAG(exp) == exp_compare)
+    {
+        struct ExpCompare compare = *EXP_COMPARE(exp);
+        enum IlOp op = compare.op == tok_equals ? il_ceqw : compare.op == tok_notEquals ? il_cnew
+                     : compare.op == '<' ? il_csltw : compare.op == tok_lessEquals ? il_cslew
+                     : compare.op == '>' ? il_csgtw : il_csgew;
+        char *left = Exp_prepare(compare.left);
+        char *right = Exp_prepare(compare.right);
+        char *finalVar = newTemp();
+        Il_emit(op, 'w', finalVar, 2, left, right);
+        free(left);
+        free(right);
+        return finalVar;
+    }
+    return NULL;
+}
+
+char *Exp_getType(ExpId exp)
+{
+    if (EXP_TAG(exp) == exp_declaration)
+    {
+        return EXP_DECLARATION(exp)->type;
+    }
+    if (EXP_TAG(exp) == exp_var)
+    {
+        char *type = EXP_VAR(exp)->type;
+        if (type == NULL)
+        {
+            compileError("type not found");
+        }
+        return type;
+    }
+    if (EXP_TAG(exp) == exp_int)
+    {
+        return "int";
+    }
+    if (EXP_TAG(exp) == exp_stringlit)
+    {
+        return "string";
+    }
+    if (EXP_TAG(exp) == exp_add)
+    {
+        // every term has to have the type of the first
+        ExpId *terms = NULL;
+        size_t size = 0;
+        size_t allocated = 0;
+        Exp_collectTerms(exp, &terms, &size, &allocated);
+        char *type = Exp_getType(terms[0]);
+        for (size_t i = 1; i < size; i++)
+        {
+            char *other = Exp_getType(terms[i]);
+            if (strcmp(type, other) != 0)
+            {
+                free(terms);
+                compileError("cannot add %s and %s", type, other);
+            }
+        }
+        free(terms);
+        return type;
+    }
+    if (EXP_TAG(exp) == exp_compare)
+    {
+        char *left = Exp_getType(EXP_COMPARE(exp)->left);
+        char *right = Exp_getType(EXP_COMPARE(exp)->right);
+        if (strcmp(left, "int") != 0 || strcmp(right, "int") != 0)
+        {
+            compileError("cannot compare %s and %s", left, right);
+        }
+        return "int";
+    }
+    if (EXP_TAG(exp) == exp_index)
+    {
+        struct ExpIndex element = *EXP_INDEX(exp);
+        long length = arrayLength(Exp_getType(element.array));
+        if (length < 0)
+        {
+            compileError("cannot index %s", Exp_getType(element.array));
+        }
+        if (strcmp(Exp_getType(element.index), "int") != 0)
+        {
+            compileError("array index must be int");
+        }
+        if (EXP_TAG(element.index) == exp_int && EXP_INT(element.index) >= length)
+        {
+            compileError("index %d out of range for int[%ld]", EXP_INT(element.index), length);
+        }
+        return "int";
+    }
+    if (EXP_TAG(exp) == exp_call)
+    {
+        struct ExpCall *call = EXP_CALL(exp);
+        if (strcmp(call->callee, "toString") == 0)
+        {
+            return "string";
+        }
+        if (call->type == NULL)
+        {
+            compileError("%s does not return a value", call->callee);
+        }
+        return call->type;
+    }
+    compileError("type not found");
+}
+
+char *getQbeType(char *type)
+{
+    if (strcmp(type, "int") == 0)
+    {
+        return "w";
+    } else if (strcmp(type, "string") == 0)
+    {
+        return "l";
+    } else
+    {
+        compileError("type not implemented");
+    }
+}
+
+char *Exp_getLeftAssignment(ExpId exp)
+{
+    char *name = NULL;
+    if (EXP_TAG(exp) == exp_declaration)
+    {
+        name = EXP_DECLARATION(exp)->name;
+    } else if (EXP_TAG(exp) == exp_var)
+    {
+        name = EXP_VAR(exp)->name;
+    } else
+    {
+        compileError("cannot assign");
+    }
+
+    int len = strlen(name) + 2;
+    char *target = malloc(sizeof(char) * len);
+    snprintf(target, len, "%%%s", name);
+    return target;
+}
+
+// a call to the function being lowered
+static bool Exp_isSelfCall(ExpId exp)
+{
+    return exp != EXP_NONE && EXP_TAG(exp) == exp_call && strcmp(EXP_CALL(exp)->callee, Ctx->CurFnName) == 0;
+}
+
+// Nothing but a bare return follows statement i of a list: it is followed
+// by one, or it is the last statement and tail says the list ends the
+// function.
+static bool Exp_endsFunction(uint32_t list, uint32_t count, uint32_t i, bool tail)
+{
+    if (i + 1 == count)
+    {
+        return tail;
+    }
+    ExpId next = EXP_CHILD(list, i + 1);
+    return EXP_TAG(next) == exp_return && EXP_RETURN(next) == EXP_NONE;
+}
+
+// Statement i of a list is a self call in tail position: returned, or in
+// a function without a result, with nothing but a bare return after it.
+static bool Exp_isTailCall(uint32_t list, uint32_t count, uint32_t i, bool tail)
+{
+    ExpId stmt = EXP_CHILD(list, i);
+    if (EXP_TAG(stmt) == exp_return)
+    {
+        return Exp_isSelfCall(EXP_RETURN(stmt));
+    }
+    if (Ctx->CurFn->retType != 0 || !Exp_isSelfCall(stmt))
+    {
+        return false;
+    }
+    return Exp_endsFunction(list, count, i, tail);
+}
+
+// whether the list, or a block of an if in it, has a self tail call
+static bool Exp_hasTailCall(uint32_t list, uint32_t count, bool tail)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        ExpId stmt = EXP_CHILD(list, i);
+        if (Exp_isTailCall(list, count, i, tail))
+        {
+            return true;
+        }
+        if (EXP_TAG(stmt) == exp_if)
+        {
+            struct ExpIf *branch = EXP_IF(stmt);
+            bool blockTail = Exp_endsFunction(list, count, i, tail);
+            if (Exp_hasTailCall(branch->then, branch->numThen, blockTail) || Exp_hasTailCall(branch->otherwise, branch->numOtherwise, blockTail))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Lowers a self call in tail position to a jump back to @body, so the
+// recursion runs in the caller's frame. Every argument is evaluated
+// before any parameter is reassigned, as the arguments may read them;
+// the peephole pass merges the extra copies away.
+static void Exp_tailCall(ExpId exp)
+{
+    struct ExpCall call = *EXP_CALL(exp);
+    struct IlFunction *fn = Ctx->CurFn;
+    char **values = malloc(sizeof(char *) * (call.numArgs + 1));
+    if (values == NULL)
+    {
+        compileError("error allocating memory");
+    }
+    for (uint32_t i = 0; i < call.numArgs; i++)
+    {
+        char *value = Exp_prepare(EXP_CHILD(call.args, i));
+        values[i] = newTemp();
+        Il_emit(il_copy, fn->params[i].type, values[i], 1, value);
+        free(value);
+    }
+    for (uint32_t i = 0; i < call.numArgs; i++)
+    {
+        Il_emit(il_copy, fn->params[i].type, fn->params[i].val, 1, values[i]);
+        free(values[i]);
+    }
+    free(values);
+    Il_emit(il_jmp, 0, NULL, 1, "@body");
+}
+
+static void Exp_ifToIL(ExpId exp, bool tail);
+
+// Lowers a list of statements, with -g marking where each new line
+// starts. tail is set when the function returns once the list is done.
+static void Exp_blockToIL(uint32_t list, uint32_t count, bool tail)
+{
+    uint32_t line = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        ExpId stmt = EXP_CHILD(list, i);
+        if (Ctx->options.debugInfo && EXP_LOC(stmt).line != line)
+        {
+            line = EXP_LOC(stmt).line;
+            Il_dbgloc(EXP_LOC(stmt));
+        }
+        if (Exp_isTailCall(list, count, i, tail))
+        {
+            Exp_tailCall(EXP_TAG(stmt) == exp_return ? EXP_RETURN(stmt) : stmt);
+            continue;
+        }
+        if (EXP_TAG(stmt) == exp_if)
+        {
+            Exp_ifToIL(stmt, Exp_endsFunction(list, count, i, tail));
+            continue;
+        }
+        Exp_toIL(stmt);
+    }
+}
+
+// Lowers a block expected to run rarely, then moves it to the function's
+// cold list so the hot path stays straight. It jumps back to end.
+static void Exp_coldBlockToIL(const char *label, uint32_t list, uint32_t count, const char *end, bool tail)
+{
+    struct IlFunction *fn = Ctx->CurFn;
+    size_t start = fn->size;
+    Il_label(label);
+    Exp_blockToIL(list, count, tail);
+    Il_emit(il_jmp, 0, NULL, 1, end);
+
+    size_t size = fn->size - start;
+    VEC_RESERVE(fn->cold, fn->coldAllocated, fn->coldSize + size);
+    memcpy(fn->cold + fn->coldSize, fn->ins + start, sizeof(struct IlIns) * size);
+    fn->coldSize += size;
+    fn->size = start;
+}
+
+// if/else as a jnz on the condition. The branch expected to run is laid
+// out right after the jnz; with a likely or unlikely hint the other one
+// goes to the end of the function. Unhinted, then comes before else.
+// tail is set when the function returns right after the if.
+static void Exp_ifToIL(ExpId exp, bool tail)
+{
+    struct ExpIf branch = *EXP_IF(exp);
+    int n = Ctx->CurFn->numBranches++;
+    char thenLabel[32];
+    char elseLabel[32];
+    char endLabel[32];
+    snprintf(thenLabel, sizeof(thenLabel), "@if%d.then", n);
+    snprintf(elseLabel, sizeof(elseLabel), "@if%d.else", n);
+    snprintf(endLabel, sizeof(endLabel), "@if%d.end", n);
+    bool hasElse = branch.numOtherwise > 0;
+
+    char *cond = Exp_prepare(branch.cond);
+    Il_emit(il_jnz, 0, NULL, 3, cond, thenLabel, hasElse ? elseLabel : endLabel);
+    free(cond);
+
+    if (branch.hint < 0)
+    {
+        Exp_coldBlockToIL(thenLabel, branch.then, branch.numThen, endLabel, tail);
+        if (hasElse)
+        {
+            Il_label(elseLabel);
+            Exp_blockToIL(branch.otherwise, branch.numOtherwise, tail);
+        }
+    } else
+    {
+        Il_label(thenLabel);
+        Exp_blockToIL(branch.then, branch.numThen, tail);
+        if (hasElse && branch.hint > 0)
+        {
+            Exp_coldBlockToIL(elseLabel, branch.otherwise, branch.numOtherwise, endLabel, tail);
+        } else if (hasElse)
+        {
+            Il_emit(il_jmp, 0, NULL, 1, endLabel);
+            Il_label(elseLabel);
+            Exp_blockToIL(branch.otherwise, branch.numOtherwise, tail);
+        }
+    }
+    Il_label(endLabel);
+}
+
+void Exp_toIL(ExpId exp)
+{
+    if (EXP_TAG(exp) == exp_function)
+    {
+        struct ExpFunction *function = EXP_FUNCTION(exp);
+        char *funcName = function->name;
+
+        // on the heap so a compile error can still free it
+        struct IlFunction *fn = calloc(1, sizeof(struct IlFunction));
+        if (fn == NULL)
+        {
+            compileError("error allocating memory");
+        }
+        Ctx->CurFn = fn;
+        if (strcmp(funcName, "entry") == 0)
+        {
+            fn->name = copyString("main");
+            fn->exported = true;
+            fn->retType = 'w';
+        } else {
+            fn->name = copyString(funcName);
+            fn->exported = function->exposed;
+            fn->retType = function->retType == NULL ? 0 : *getQbeType(function->retType);
+        }
+
+        fn->params = function->numParams > 0 ? calloc(function->numParams, sizeof(struct IlArg)) : NULL;
+        for (uint32_t i = 0; i < function->numParams; i++)
+        {
+            struct ExpParam *param = &Nodes->params.items[function->params + i];
+            int len = strlen(param->name) + 2;
+            fn->params[i].type = *getQbeType(param->type);
+            fn->params[i].val = malloc(len);
+            snprintf(fn->params[i].val, len, "%%%s", param->name);
+            fn->numParams++;
+        }
+
+        fn->section = Profile_section(funcName);
+        Ctx->CurFnName = funcName;
+
+        // self tail calls jump to @body, just past @start, so the entry
+        // block has no predecessors and --instrument counts each entry once.
+        // Arrays are allocated before it, once per call rather than once per
+        // iteration, which also keeps QBE's allocs in the start block.
+        Il_label("@start");
+        Exp_allocArrays(function->body, function->numExprs);
+        if (Exp_hasTailCall(function->body, function->numExprs, true))
+        {
+            Il_label("@body");
+        }
+
+        Exp_blockToIL(function->body, function->numExprs, true);
+        // entry falls off the end with 0; every other function with a
+        // result was checked to return, and the peephole pass drops this
+        Il_return(fn->retType != 0 ? "0" : NULL);
+
+        VEC_RESERVE(fn->ins, fn->allocated, fn->size + fn->coldSize);
+        if (fn->coldSize > 0)
+        {
+            memcpy(fn->ins + fn->size, fn->cold, sizeof(struct IlIns) * fn->coldSize);
+        }
+        fn->size += fn->coldSize;
+        free(fn->cold);
+        fn->cold = NULL;
+        fn->coldSize = fn->coldAllocated = 0;
+        Il_cse(fn);
+        Il_peephole(fn);
+        Il_elimChecks(fn);
+        if (Ctx->options.instrument)
+        {
+            Il_instrument(fn, funcName, fn->exported);
+        }
+
+        if (Ctx->options.backend == backend_x86)
+        {
+            X86_printFunction(fn, Ctx->CodeOut);
+        } else
+        {
+            IlFunction_print(fn, Ctx->CodeOut);
+        }
+        if (Ctx->options.ilStats != NULL)
+        {
+            IlStats_function(fn, Ctx->options.ilStats);
+        }
+        IlFunction_free(fn);
+        free(fn);
+        Ctx->CurFn = NULL;
+        Ctx->CurFnName = NULL;
+    }
+
+    if (EXP_TAG(exp) == exp_declaration)
+    {
+        struct ExpDeclaration *decl = EXP_DECLARATION(exp);
+        long length = arrayLength(decl->type);
+        if (length >= 0)
+        {
+            Exp_declareArray(decl->name, length);
+        }
+    }
+
+    if (EXP_TAG(exp) == exp_assignment && EXP_TAG(EXP_ASSIGNMENT(exp)->target) == exp_index)
+    {
+        struct ExpAssignment asign = *EXP_ASSIGNMENT(exp);
+        if (strcmp(Exp_getType(asign.target), Exp_getType(asign.right)) != 0)
+        {
+            compileError("cannot assign %s to int", Exp_getType(asign.right));
+        }
+
+        char *value = Exp_prepare(asign.right);
+        char *addr = Exp_prepareElement(asign.target);
+        Il_emit(il_storew, 0, NULL, 2, value, addr);
+        free(value);
+        free(addr);
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_assignment)
+    {
+        struct ExpAssignment asign = *EXP_ASSIGNMENT(exp);
+
+        char *type = Exp_getType(asign.target);
+        char qbeType = *getQbeType(type);
+
+        if (EXP_TAG(asign.right) == exp_add && strcmp(Exp_getType(asign.right), "int") == 0)
+        {
+            char *left = Exp_prepare(EXP_ADD(asign.right)->left);
+            char *right = Exp_prepare(EXP_ADD(asign.right)->right);
+            char *target = Exp_getLeftAssignment(asign.target);
+            Il_emit(il_add, qbeType, target, 2, left, right);
+            free(target);
+            free(left);
+            free(right);
+        } else
+        {
+            char *value = Exp_prepare(asign.right);
+            if (value == NULL)
+            {
+                compileError("cannot assign");
+            }
+            char *target = Exp_getLeftAssignment(asign.target);
+            Il_emit(il_copy, qbeType, target, 1, value);
+            free(target);
+            free(value);
+        }
+    }
+
+    if (EXP_TAG(exp) == exp_if)
+    {
+        Exp_ifToIL(exp, false);
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_return)
+    {
+        ExpId value = EXP_RETURN(exp);
+        if (value == EXP_NONE)
+        {
+            Il_return(Ctx->CurFn->retType != 0 ? "0" : NULL);
+            return;
+        }
+        char *result = Exp_prepare(value);
+        if (result == NULL)
+        {
+            compileError("cannot return");
+        }
+        Il_return(result);
+        free(result);
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_call)
+    {
+        struct ExpCall call = *EXP_CALL(exp);
+        if (!isBuiltin(call.callee))
+        {
+            Exp_prepareCall(exp, false);
+            return;
+        }
+
+        if (strcmp(call.callee, "print") == 0)
+        {
+            char **vars = NULL;
+            size_t allocated = 0;
+            size_t size = 0;
+            for (uint32_t i = 0; i < call.numArgs; i++)
+            {
+                char * finalVar = Exp_prepare(EXP_CHILD(call.args, i));
+                VEC_PUSH(vars, size, allocated, finalVar);
+            }
+
+            for (size_t i = 0; i < size; i++)
+            {
+                Il_call(0, NULL, "$dputs", 2, 'l', vars[i], 'w', "1");
+                free(vars[i]);
+            }
+            free(vars);
+        }
+    }
+}
+
+void Exp_print(ExpId exp)
+{
+    if (exp == EXP_NONE)
+    {
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_function)
+    {
+        struct ExpFunction *fn = EXP_FUNCTION(exp);
+        Exp_printPrototype(fn);
+        printf(" {\n");
+        for (uint32_t i = 0; i < fn->numExprs; i++)
+        {
+            printf("    ");
+            Exp_print(EXP_CHILD(fn->body, i));
+            printf(";\n");
+        }
+        printf("}\n");
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_declaration)
+    {
+        printf("%s: %s", EXP_DECLARATION(exp)->name, EXP_DECLARATION(exp)->type);
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_assignment)
+    {
+        Exp_print(EXP_ASSIGNMENT(exp)->target);
+        printf("=");
+        Exp_print(EXP_ASSIGNMENT(exp)->right);
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_int)
+    {
+        printf("%d", EXP_INT(exp));
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_var)
+    {
+        printf("%s", EXP_VAR(exp)->name);
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_add)
+    {
+        ExpId *terms = NULL;
+        size_t size = 0;
+        size_t allocated = 0;
+        Exp_collectTerms(exp, &terms, &size, &allocated);
+        for (size_t i = 0; i < size; i++)
+        {
+            printf(i == 0 ? "" : "+");
+            Exp_print(terms[i]);
+        }
+        free(terms);
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_index)
+    {
+        Exp_print(EXP_INDEX(exp)->array);
+        printf("[");
+        Exp_print(EXP_INDEX(exp)->index);
+        printf("]");
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_compare)
+    {
+        struct ExpCompare *compare = EXP_COMPARE(exp);
+        int op = compare->op;
+        Exp_print(compare->left);
+        printf("%s", op == tok_equals ? "==" : op == tok_notEquals ? "!=" : op == tok_lessEquals ? "<="
+                   : op == tok_greaterEquals ? ">=" : op == '<' ? "<" : ">");
+        Exp_print(compare->right);
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_if)
+    {
+        struct ExpIf *branch = EXP_IF(exp);
+        printf("if %s", branch->hint > 0 ? "likely " : branch->hint < 0 ? "unlikely " : "");
+        Exp_print(branch->cond);
+        printf(" {");
+        for (uint32_t i = 0; i < branch->numThen; i++)
+        {
+            printf(" ");
+            Exp_print(EXP_CHILD(branch->then, i));
+            printf(";");
+        }
+        printf(" }");
+        if (branch->numOtherwise > 0)
+        {
+            printf(" else {");
+            for (uint32_t i = 0; i < branch->numOtherwise; i++)
+            {
+                printf(" ");
+                Exp_print(EXP_CHILD(branch->otherwise, i));
+                printf(";");
+            }
+            printf(" }");
+        }
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_return)
+    {
+        printf("return");
+        if (EXP_RETURN(exp) != EXP_NONE)
+        {
+            printf(" ");
+            Exp_print(EXP_RETURN(exp));
+        }
+        return;
+    }
+
+    if (EXP_TAG(exp) == exp_call)
+    {
+        struct ExpCall *call = EXP_CALL(exp);
+        printf("%s(", call->callee);
+        for (uint32_t i = 0; i < call->numArgs; i++)
+        {
+            if (i > 0)
+            {
+                printf(",");
+            }
+            Exp_print(EXP_CHILD(call->args, i));
+        }
+        printf(")");
+        return;
+    }
+}
+
+// Under --pipeline the parser fills one Ast per batch of functions and
+// hands the batch to the codegen thread once it holds PIPELINE_BATCH_NODES
+// nodes. Batches are independent trees, so neither thread ever sees the
+// other's arrays move. Codegen writes into a memory stream that main
+// prints after the string literal data, keeping the output identical.
+#define PIPELINE_BATCH_NODES 4096
+
+typedef struct AstBatch
+{
+    struct Ast ast;
+    ExpId *functions;
+    size_t size;
+    size_t allocated;
+    struct AstBatch *next;
+} AstBatch;
+
+typedef struct BatchQueue
+{
+    struct AstBatch *head;
+    struct AstBatch *tail;
+    struct AstBatch *filling;   // the batch the parser is adding to
+    struct AstBatch *lowering;  // the batch codegen is working on
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_t thread;
+    struct Funcoc *ctx;
+    char *output;
+    size_t outputLen;
+} BatchQueue;
+
+static struct AstBatch *AstBatch_new()
+{
+    struct AstBatch *batch = calloc(1, sizeof(struct AstBatch));
+    if (batch == NULL)
+    {
+        compileError("error allocating memory");
+    }
+    return batch;
+}
+
+static void AstBatch_free(struct AstBatch *batch)
+{
+    Ast_free(&batch->ast);
+    free(batch->functions);
+    free(batch);
+}
+
+static void BatchQueue_push(struct BatchQueue *queue, struct AstBatch *batch)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == NULL)
+    {
+        queue->head = batch;
+    } else
+    {
+        queue->tail->next = batch;
+    }
+    queue->tail = batch;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// called by the parser for every finished top level function
+static void BatchQueue_add(struct BatchQueue *queue, ExpId exp)
+{
+    checkFailed();
+    struct AstBatch *batch = queue->filling;
+    VEC_PUSH(batch->functions, batch->size, batch->allocated, exp);
+    if (batch->ast.size >= PIPELINE_BATCH_NODES)
+    {
+        BatchQueue_push(queue, batch);
+        queue->filling = AstBatch_new();
+        Nodes = &queue->filling->ast;
+    }
+}
+
+static void *BatchQueue_lower(void *arg)
+{
+    struct BatchQueue *queue = arg;
+    jmp_buf onError;
+    Ctx = queue->ctx;
+    ErrorJump = &onError;
+    if (setjmp(onError) != 0)
+    {
+        return NULL;
+    }
+
+    while (true)
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->head == NULL && !queue->done)
+        {
+            pthread_cond_wait(&queue->ready, &queue->lock);
+        }
+        struct AstBatch *batch = queue->head;
+        if (batch != NULL)
+        {
+            queue->head = batch->next;
+            queue->tail = queue->head == NULL ? NULL : queue->tail;
+        }
+        queue->lowering = batch;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (batch == NULL || atomic_load(&Ctx->failed))
+        {
+            return NULL;
+        }
+
+        Nodes = &batch->ast;
+        for (size_t i = 0; i < batch->size; i++)
+        {
+            Exp_toIL(batch->functions[i]);
+        }
+        queue->lowering = NULL;
+        AstBatch_free(batch);
+    }
+}
+
+static void BatchQueue_start(struct BatchQueue *queue)
+{
+    Ctx->CodeOut = open_memstream(&queue->output, &queue->outputLen);
+    if (Ctx->CodeOut == NULL)
+    {
+        compileError("error allocating memory");
+    }
+
+    queue->filling = AstBatch_new();
+    Nodes = &queue->filling->ast;
+    queue->done = false;
+    queue->ctx = Ctx;
+    if (pthread_create(&queue->thread, NULL, BatchQueue_lower, queue) != 0)
+    {
+        compileError("could not start codegen thread");
+    }
+    Ctx->codegenStarted = true;
+}
+
+// Hands over the last batch and waits for codegen to finish
+static void BatchQueue_finish(struct BatchQueue *queue)
+{
+    BatchQueue_push(queue, queue->filling);
+    queue->filling = NULL;
+    Nodes = Ctx->Tree;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->done = true;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+    pthread_join(queue->thread, NULL);
+    Ctx->codegenStarted = false;
+    checkFailed();
+
+    fclose(Ctx->CodeOut);
+    Ctx->CodeOut = Ctx->out;
+}
+
+// Stops codegen without waiting for the queued batches and frees them,
+// after an error. Ctx->failed must already be set.
+static void BatchQueue_stop(struct BatchQueue *queue)
+{
+    if (Ctx->codegenStarted)
+    {
+        pthread_mutex_lock(&queue->lock);
+        queue->done = true;
+        pthread_cond_signal(&queue->ready);
+        pthread_mutex_unlock(&queue->lock);
+        pthread_join(queue->thread, NULL);
+        Ctx->codegenStarted = false;
+    }
+
+    while (queue->head != NULL)
+    {
+        struct AstBatch *batch = queue->head;
+        queue->head = batch->next;
+        AstBatch_free(batch);
+    }
+    queue->tail = NULL;
+    if (queue->lowering != NULL)
+    {
+        AstBatch_free(queue->lowering);
+        queue->lowering = NULL;
+    }
+    if (queue->filling != NULL)
+    {
+        AstBatch_free(queue->filling);
+        queue->filling = NULL;
+    }
+    if (Ctx->CodeOut != NULL && Ctx->CodeOut != Ctx->out)
+    {
+        fclose(Ctx->CodeOut);
+        Ctx->CodeOut = Ctx->out;
+    }
+    (free)(queue->output);
+    queue->output = NULL;
+    queue->outputLen = 0;
+}
+
+// prints what codegen wrote, the buffer comes from libc and not Stats_malloc
+static void BatchQueue_print(struct BatchQueue *queue)
+{
+    fwrite(queue->output, 1, queue->outputLen, Ctx->out);
+    (free)(queue->output);
+    queue->output = NULL;
+    queue->outputLen = 0;
+}
+
+static int getNextToken()
+{
+    if (Ctx->options.pipeline)
+    {
+        // the lexer stops after eof, so keep returning it
+        if (Ctx->CurToken.kind != tok_eof || Ctx->CurIdx < 0)
+        {
+            Ctx->CurToken = TokenRing_pop(Ctx->tokenRing);
+            Ctx->CurIdx++;
+        }
+    } else
+    {
+        if (Ctx->CurIdx + 1 < (long)Ctx->Tokens.size)
+        {
+            Ctx->CurIdx++;
+        }
+        Ctx->CurToken = (struct LexToken) { Ctx->Tokens.kind[Ctx->CurIdx], Ctx->Tokens.offset[Ctx->CurIdx], Ctx->Tokens.length[Ctx->CurIdx], Ctx->Tokens.value[Ctx->CurIdx], Ctx->Tokens.line[Ctx->CurIdx], Ctx->Tokens.column[Ctx->CurIdx] };
+    }
+
+    Ctx->CurTok = Ctx->CurToken.kind;
+    if (Ctx->CurTok == tok_identifier || Ctx->CurTok == tok_declaration)
+    {
+        Ctx->IdentifierStr = tokenText(Ctx->CurToken.offset, Ctx->CurToken.length);
+    } else if (Ctx->CurTok == tok_int)
+    {
+        Ctx->NumVal = Ctx->CurToken.value;
+    }
+    return Ctx->CurTok;
+}
+
+// kind of the token n positions after the current one, tok_eof past the end
+int peekToken(int n)
+{
+    if (Ctx->options.pipeline)
+    {
+        return Ctx->CurTok == tok_eof ? tok_eof : TokenRing_peek(Ctx->tokenRing, n - 1)->kind;
+    }
+
+    long idx = Ctx->CurIdx + n;
+    if (idx >= (long)Ctx->Tokens.size)
+    {
+        idx = Ctx->Tokens.size - 1;
+    }
+    return Ctx->Tokens.kind[idx];
+}
+
+typedef struct TokPrecedenceArray
+{
+    struct TokPrecedenceMap *map;
+    size_t size;
+} TokPrecedenceArray;
+
+typedef struct TokPrecedenceMap
+{
+    char Key;
+    int Val;
+} TokPrecedenceMap;
+
+static struct TokPrecedenceArray BinopPrecedenceArr =
+{
+    .size = 9,
+    .map = (struct TokPrecedenceMap[])
+    {
+        [0] = { .Key = '<', .Val = 10 },
+        [1] = { .Key = '+', .Val = 20 },
+        [2] = { .Key = '-', .Val = 20 },
+        [3] = { .Key = '*', .Val = 40 },
+        [4] = { .Key = '>', .Val = 10 },
+        [5] = { .Key = tok_equals, .Val = 10 },
+        [6] = { .Key = tok_notEquals, .Val = 10 },
+        [7] = { .Key = tok_lessEquals, .Val = 10 },
+        [8] = { .Key = tok_greaterEquals, .Val = 10 }
+    }
+};
+
+static int getValue(struct TokPrecedenceArray arr, char key)
+{
+    for (size_t i = 0; i < arr.size; i++)
+    {
+        struct TokPrecedenceMap chk = arr.map[i];
+        if (chk.Key == key)
+        {
+            return chk.Val;
+        }
+    }
+
+    return -1;
+}
+
+static int GetTokPrecedence()
+{
+    if (Ctx->CurTok > 127) // is not ascii
+    {
+        return -1;
+    }
+
+    int TokPrec = getValue(BinopPrecedenceArr, Ctx->CurTok);
+    if (TokPrec <= 0) return -1;
+    return TokPrec;
+}
+
+static ExpId ParsePrimary();
+
+// Decodes the escapes in len bytes of literal text into out, which needs
+// room for len bytes, returning the decoded length. The text between
+// escapes is copied in runs.
+static size_t decodeEscapes(const char *text, size_t len, char *out)
+{
+    size_t n = 0;
+    size_t i = 0;
+    while (i < len)
+    {
+        const char *escape = memchr(text + i, '\\', len - i);
+        size_t run = escape == NULL ? len - i : (size_t)(escape - text) - i;
+        memcpy(out + n, text + i, run);
+        n += run;
+        i += run;
+        if (escape == NULL)
+        {
+            break;
+        }
+
+        // the lexer only lets a \\ through with a character after it
+        char c = text[i + 1];
+        i += 2;
+        switch (c)
+        {
+            case 'n': out[n++] = '\n'; break;
+            case 't': out[n++] = '\t'; break;
+            case 'r': out[n++] = '\r'; break;
+            case '0': out[n++] = '\0'; break;
+            case '\\':
+            case '"':
+            case '\'':
+                out[n++] = c;
+                break;
+            case 'x':
+                if (i + 2 > len || !isxdigit((unsigned char)text[i]) || !isxdigit((unsigned char)text[i + 1]))
+                {
+                    compileError("expected two hex digits after \\x");
+                }
+                char hex[3] = { text[i], text[i + 1], '\0' };
+                out[n++] = (char)strtol(hex, NULL, 16);
+                i += 2;
+                break;
+            default:
+                compileError("unknown escape \\%c", c);
+        }
+    }
+    return n;
+}
+
+// A "..." literal with its escapes decoded, or consecutive \\ lines
+// joined by newlines. Text that needs neither is not copied.
+static ExpId ParseStringLiteral()
+{
+    struct SourceLoc loc = CurLoc();
+    struct StringLiteral lit = { .bytes = Ctx->Source + Ctx->CurToken.offset, .length = Ctx->CurToken.length, .owned = false };
+    bool raw = Ctx->CurTok == tok_rawline;
+    if (!raw && Ctx->CurToken.value != 0)
+    {
+        char *bytes = malloc(lit.length + 1);
+        if (bytes == NULL)
+        {
+            compileError("error allocating memory");
+        }
+        lit = (struct StringLiteral) { .bytes = bytes, .length = decodeEscapes(lit.bytes, lit.length, bytes), .owned = true };
+    }
+    getNextToken();
+
+    if (raw && Ctx->CurTok == tok_rawline)
+    {
+        char *bytes = NULL;
+        size_t size = 0;
+        size_t allocated = 0;
+        VEC_RESERVE(bytes, allocated, lit.length);
+        memcpy(bytes, lit.bytes, lit.length);
+        size = lit.length;
+        while (Ctx->CurTok == tok_rawline)
+        {
+            VEC_RESERVE(bytes, allocated, size + 1 + Ctx->CurToken.length);
+            bytes[size++] = '\n';
+            memcpy(bytes + size, Ctx->Source + Ctx->CurToken.offset, Ctx->CurToken.length);
+            size += Ctx->CurToken.length;
+            getNextToken();
+        }
+        lit = (struct StringLiteral) { .bytes = bytes, .length = size, .owned = true };
+    }
+
+    pthread_mutex_lock(&Ctx->literalsLock);
+    int literalId = Ctx->curLit;
+    VEC_PUSH(Ctx->stringLiterals, Ctx->curLit, Ctx->literalsAllocated, lit);
+    pthread_mutex_unlock(&Ctx->literalsLock);
+
+    ExpId exp = Exp_newStringlit(literalId);
+    EXP_LOC(exp) = loc;
+    return exp;
+}
+
+// Replaces the operator on top of the stack and the two operands below
+// it with their node
+static void ReduceOperator()
+{
+    ExpId rhs = Ctx->operands[--Ctx->numOperands];
+    ExpId lhs = Ctx->operands[Ctx->numOperands - 1];
+    int op = Ctx->operators[--Ctx->numOperators];
+
+    struct SourceLoc loc = EXP_LOC(lhs);
+    ExpId exp = op == '+' ? Exp_newAdd(lhs, rhs) : Exp_newCompare(op, lhs, rhs);
+    EXP_LOC(exp) = loc;
+    Ctx->operands[Ctx->numOperands - 1] = exp;
+}
+
+static ExpId ParseIntExpr()
+{
+    ExpId exp = Exp_newInt(Ctx->NumVal);
+    getNextToken();
+    return exp;
+}
+
+
+// The parser recurses for each call argument, index, block or value
+// nested in another, and the walks over the tree for each node other
+// than a sum, so nesting deeper than --max-nesting (this by default) is a
+// compile error rather than a stack overflow.
+#define EXPRESSION_DEPTH_MAX 1000
+
+static int maxNesting()
+{
+    return Ctx->options.maxNesting > 0 ? Ctx->options.maxNesting : EXPRESSION_DEPTH_MAX;
+}
+
+// Precedence climbing over explicit operand and operator stacks, with
+// pending '(' kept on the operator stack, so long chains and deep nesting
+// cost heap rather than C stack.
+static ExpId ParseExpression()
+{
+    if (++Ctx->nesting > maxNesting())
+    {
+        compileError("expression nested too deeply, the limit is %d levels", maxNesting());
+    }
+    size_t operandBase = Ctx->numOperands;
+    size_t operatorBase = Ctx->numOperators;
+    int open = 0;
+    while (1)
+    {
+        while (Ctx->CurTok == '(')
+        {
+            VEC_PUSH(Ctx->operators, Ctx->numOperators, Ctx->operatorsAllocated, '(');
+            open++;
+            getNextToken(); // eat (
+        }
+
+        ExpId operand = ParsePrimary();
+        if (operand == EXP_NONE)
+        {
+            Ctx->numOperands = operandBase;
+            Ctx->numOperators = operatorBase;
+            Ctx->nesting--;
+            return EXP_NONE;
+        }
+        VEC_PUSH(Ctx->operands, Ctx->numOperands, Ctx->operandsAllocated, operand);
+
+        while (Ctx->CurTok == ')' && open > 0)
+        {
+            while (Ctx->operators[Ctx->numOperators - 1] != '(')
+            {
+                ReduceOperator();
+            }
+            Ctx->numOperators--;
+            open--;
+            getNextToken(); // eat )
+        }
+
+        int TokPrec = GetTokPrecedence();
+        if (TokPrec < 0)
+        {
+            if (open > 0)
+            {
+                compileError("expected ')'");
+            }
+            break;
+        }
+        if (Ctx->CurTok == '-' || Ctx->CurTok == '*')
+        {
+            compileError("not implemented");
+        }
+
+        // left associative: finish pending operators binding as tightly
+        while (Ctx->numOperators > operatorBase && Ctx->operators[Ctx->numOperators - 1] != '('
+               && getValue(BinopPrecedenceArr, Ctx->operators[Ctx->numOperators - 1]) >= TokPrec)
+        {
+            ReduceOperator();
+        }
+        VEC_PUSH(Ctx->operators, Ctx->numOperators, Ctx->operatorsAllocated, Ctx->CurTok);
+        getNextToken(); // eat binop
+    }
+
+    while (Ctx->numOperators > operatorBase)
+    {
+        ReduceOperator();
+    }
+    Ctx->nesting--;
+    return Ctx->operands[--Ctx->numOperands];
+}
+
+// Parses the [N] after an element type, returning the type as "int[N]"
+static char *ParseArrayType(char *elementType)
+{
+    if (strcmp(elementType, "int") != 0)
+    {
+        compileError("only int arrays are supported");
+    }
+
+    getNextToken(); // eat [
+    if (Ctx->CurTok != tok_int || Ctx->NumVal <= 0)
+    {
+        compileError("expected array length");
+    }
+    int length = Ctx->NumVal;
+
+    getNextToken();
+    if (Ctx->CurTok != ']')
+    {
+        compileError("expected ']'");
+    }
+    getNextToken(); // eat ]
+
+    int len = snprintf(NULL, 0, "int[%d]", length) + 1;
+    char *type = malloc(len);
+    snprintf(type, len, "int[%d]", length);
+    free(elementType);
+    return type;
+}
+
+// Builds target = right, which has to have the target's type
+static ExpId CheckAssignment(ExpId target, ExpId right, struct SourceLoc loc)
+{
+    char *type = Exp_getType(target);
+    if (strcmp(type, Exp_getType(right)) != 0)
+    {
+        compileError("cannot assign %s to %s", Exp_getType(right), type);
+    }
+    ExpId exp = Exp_newAssignment(target, right);
+    EXP_LOC(exp) = loc;
+    return exp;
+}
+
+static ExpId ParseDeclaration()
+{
+    struct SourceLoc loc = CurLoc();
+    char *varName = Ctx->IdentifierStr;
+
+    getNextToken(); // eat type
+
+    char *type = Ctx->IdentifierStr;
+
+    getNextToken(); // eat '='
+    if (Ctx->CurTok == '[')
+    {
+        type = ParseArrayType(type);
+    }
+
+    struct VarRefKeyValue keyval = (struct VarRefKeyValue) { .Key = varName, .Val = type };
+    VarRefMap_add(&Ctx->varMap, keyval);
+
+    ExpId lhs = Exp_newDeclaration(type, varName);
+    EXP_LOC(lhs) = loc;
+
+    if (Ctx->CurTok == ';')
+    {
+        return lhs;
+    }
+
+    if (arrayLength(type) >= 0)
+    {
+        compileError("arrays cannot be initialized");
+    }
+
+    getNextToken(); // advance to expression
+    ExpId body = ParseExpression();
+
+    if (body == EXP_NONE)
+    {
+        compileError("expected expression");
+    }
+
+    ExpId expr = CheckAssignment(lhs, body, loc);
+
+    if (Ctx->CurTok != ';')
+    {
+        compileError("expected ; after variable declaration");
+    }
+
+    return expr;
+}
+
+// Parses the type name after a parameter or prototype
+static char *ParseValueType()
+{
+    if (Ctx->CurTok != tok_identifier)
+    {
+        compileError("expected type");
+    }
+    char *type = valueType(Ctx->IdentifierStr);
+    free(Ctx->IdentifierStr);
+    getNextToken(); // eat type
+    if (Ctx->CurTok == '[')
+    {
+        compileError("arrays cannot be passed or returned");
+    }
+    return type;
+}
+
+// Parses name(a: int, b: string): int up to the { or ; that follows and
+// fills in the name, parameters and return type of fn
+static void ParsePrototype(struct ExpFunction *fn)
+{
+    if (Ctx->CurTok != tok_identifier)
+    {
+        compileError("Expected function name");
+    }
+
+    fn->name = Ctx->IdentifierStr;
+    getNextToken();
+    if (Ctx->CurTok != '(')
+    {
+        compileError("expected '(' after %s", fn->name);
+    }
+    getNextToken(); // eat (
+
+    fn->params = Nodes->params.size;
+    while (Ctx->CurTok != ')')
+    {
+        if (Ctx->CurTok == tok_identifier)
+        {
+            compileError("parameter %s of %s needs a type", Ctx->IdentifierStr, fn->name);
+        }
+        if (Ctx->CurTok != tok_declaration)
+        {
+            compileError("expected parameter of %s", fn->name);
+        }
+        char *name = Ctx->IdentifierStr;
+        getNextToken(); // eat name:
+        AST_PUSH(params, ((struct ExpParam) { .name = name, .type = ParseValueType() }));
+
+        if (Ctx->CurTok == ',')
+        {
+            getNextToken();
+        } else if (Ctx->CurTok != ')')
+        {
+            compileError("expected ')' or ',' in parameter list");
+        }
+    }
+    fn->numParams = Nodes->params.size - fn->params;
+    getNextToken(); // eat ')'
+
+    if (Ctx->CurTok == ':')
+    {
+        getNextToken(); // eat :
+        fn->retType = ParseValueType();
+    }
+
+    if (Ctx->CurTok != '{' && Ctx->CurTok != ';')
+    {
+        compileError("expected '{' or ';' after prototype of %s", fn->name);
+    }
+}
+
+// Declares fn's prototype, returning the signature index
+static long DeclarePrototype(struct ExpFunction *fn, bool defined)
+{
+    char **paramTypes = malloc(sizeof(char *) * (fn->numParams + 1));
+    if (paramTypes == NULL)
+    {
+        compileError("error allocating memory");
+    }
+    for (uint32_t i = 0; i < fn->numParams; i++)
+    {
+        paramTypes[i] = Nodes->params.items[fn->params + i].type;
+    }
+    long sig = Signature_declare(fn->name, fn->retType, paramTypes, fn->numParams, defined);
+    free(paramTypes);
+    return sig;
+}
+
+
+void expect(char expect)
+{
+    getNextToken();
+    if (Ctx->CurTok != expect)
+    {
+        compileError("expected: %c got: %c", expect, Ctx->CurTok);
+    }
+}
+
+// Whether control cannot fall off the end of a list: some statement in it
+// returns, or is an if and else that both always return.
+static bool Exp_alwaysReturns(uint32_t list, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        ExpId stmt = EXP_CHILD(list, i);
+        if (EXP_TAG(stmt) == exp_return)
+        {
+            return true;
+        }
+        if (EXP_TAG(stmt) == exp_if)
+        {
+            struct ExpIf *branch = EXP_IF(stmt);
+            if (Exp_alwaysReturns(branch->then, branch->numThen) && Exp_alwaysReturns(branch->otherwise, branch->numOtherwise))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// A prototype followed by ; only declares the function, for calls that
+// come before its definition or go to another module
+static ExpId ParseDefinition(bool exposed)
+{
+    getNextToken(); // eat fn.
+    struct SourceLoc loc = CurLoc();
+    struct ExpFunction fn = { .exposed = exposed };
+    ParsePrototype(&fn);
+    bool entry = strcmp(fn.name, "entry") == 0;
+    if (entry && fn.numParams > 0)
+    {
+        compileError("entry takes no parameters");
+    }
+    if (entry && fn.retType != NULL && strcmp(fn.retType, "int") != 0)
+    {
+        compileError("entry can only return int");
+    }
+
+    if (Ctx->CurTok == ';')
+    {
+        DeclarePrototype(&fn, false);
+        for (uint32_t i = 0; i < fn.numParams; i++)
+        {
+            free(Nodes->params.items[fn.params + i].name);
+        }
+        Nodes->params.size = fn.params;
+        free(fn.name);
+        return EXP_NONE;
+    }
+    getNextToken(); // eat {
+
+    long sig = DeclarePrototype(&fn, true);
+    if (exposed)
+    {
+        Interface_addExport(fn.name, sig);
+    }
+    for (uint32_t i = 0; i < fn.numParams; i++)
+    {
+        struct ExpParam *param = &Nodes->params.items[fn.params + i];
+        VarRefMap_add(&Ctx->varMap, (struct VarRefKeyValue) { .Key = param->name, .Val = param->type });
+    }
+    Ctx->CurSignature = sig;
+
+    // statements may nest their own lists, so the body is collected first
+    // and copied into one range at the end
+    ExpId *exprs = NULL;
+    size_t allocated = 0;
+    size_t size = 0;
+    while (Ctx->CurTok != '}')
+    {
+        if (Ctx->CurTok == tok_eof)
+        {
+            compileError("expected }");
+        }
+        ExpId e = ParseExpression();
+        if (e == EXP_NONE)
+            continue;
+
+        VEC_PUSH(exprs, size, allocated, e);
+    }
+
+    Ctx->CurSignature = -1;
+
+    fn.body = Exp_list(exprs, size);
+    fn.numExprs = size;
+    free(exprs);
+    // entry falls off the end with 0, like main in C
+    if (fn.retType != NULL && !entry && !Exp_alwaysReturns(fn.body, fn.numExprs))
+    {
+        compileError("missing return at the end of %s", fn.name);
+    }
+    ExpId exp = Exp_newFunction(fn);
+    EXP_LOC(exp) = loc;
+    return exp;
+}
+
+// return, or return expr, checked against the enclosing prototype
+static ExpId ParseReturn()
+{
+    struct SourceLoc loc = CurLoc();
+    getNextToken(); // eat return
+    if (Ctx->CurSignature < 0)
+    {
+        compileError("return outside of a function");
+    }
+    struct Signature *sig = &Ctx->signatures->items[Ctx->CurSignature];
+
+    ExpId value = EXP_NONE;
+    if (Ctx->CurTok != ';')
+    {
+        value = ParseExpression();
+        if (value == EXP_NONE)
+        {
+            compileError("expected expression");
+        }
+    }
+
+    if (value == EXP_NONE && sig->retType != NULL)
+    {
+        compileError("%s must return %s", sig->name, sig->retType);
+    }
+    if (value != EXP_NONE && sig->retType == NULL)
+    {
+        compileError("%s does not return a value", sig->name);
+    }
+    if (value != EXP_NONE && strcmp(Exp_getType(value), sig->retType) != 0)
+    {
+        compileError("%s must return %s, got %s", sig->name, sig->retType, Exp_getType(value));
+    }
+
+    ExpId exp = Exp_newReturn(value);
+    EXP_LOC(exp) = loc;
+    return exp;
+}
+
+// Resolves the callee of a call to a user function and checks the
+// arguments against its prototype, returning its result type
+static char *CheckCall(char *callee, ExpId *args, size_t numArgs)
+{
+    struct Signature *sig = Signature_find(callee);
+    if (sig == NULL)
+    {
+        compileError("unknown function %s", callee);
+    }
+    if (sig->numParams != numArgs)
+    {
+        compileError("%s takes %u arguments, got %zu", callee, sig->numParams, numArgs);
+    }
+    for (size_t i = 0; i < numArgs; i++)
+    {
+        char *expected = Ctx->signatures->paramTypes[sig->params + i];
+        char *type = Exp_getType(args[i]);
+        if (strcmp(type, expected) != 0)
+        {
+            compileError("argument %zu of %s must be %s, got %s", i + 1, callee, expected, type);
+        }
+    }
+    return sig->retType;
+}
+
+// Checks the arguments of a call to a builtin against its entry in
+// Builtins
+static void CheckBuiltin(char *callee, ExpId *args, size_t numArgs)
+{
+    struct Builtin *builtin = NULL;
+    for (size_t i = 0; i < NUM_BUILTINS; i++)
+    {
+        if (strcmp(Builtins[i].name, callee) == 0)
+        {
+            builtin = &Builtins[i];
+        }
+    }
+    if (builtin->numParams >= 0 && (size_t)builtin->numParams != numArgs)
+    {
+        compileError("%s takes %d arguments, got %zu", callee, builtin->numParams, numArgs);
+    }
+    for (size_t i = 0; i < numArgs; i++)
+    {
+        char *type = Exp_getType(args[i]);
+        if (strcmp(type, builtin->param) != 0)
+        {
+            compileError("argument %zu of %s must be %s, got %s", i + 1, callee, builtin->param, type);
+        }
+    }
+}
+
+static ExpId ParseIdentifierExpr()
+{
+    struct SourceLoc loc = CurLoc();
+    char *IdName = Ctx->IdentifierStr;
+    getNextToken();
+
+    if (Ctx->CurTok == '[')
+    {
+        ExpId array = Exp_newVar(IdName);
+        EXP_LOC(array) = loc;
+        getNextToken(); // eat [
+
+        ExpId index = ParseExpression();
+        if (index == EXP_NONE || Ctx->CurTok != ']')
+        {
+            compileError("expected ']'");
+        }
+        getNextToken(); // eat ]
+
+        ExpId element = Exp_newIndex(array, index);
+        EXP_LOC(element) = loc;
+        if (Ctx->CurTok != tok_assignment)
+        {
+            return element;
+        }
+        getNextToken(); // eat =
+
+        ExpId right = ParseExpression();
+        if (right == EXP_NONE)
+        {
+            compileError("expected expression");
+        }
+        return CheckAssignment(element, right, loc);
+    }
+
+    if (Ctx->CurTok != '(' && Ctx->CurTok != tok_assignment) // simple variable ref
+    {
+        ExpId var_exp = Exp_newVar(IdName);
+        EXP_LOC(var_exp) = loc;
+        return var_exp;
+    }
+
+    if (Ctx->CurTok == tok_assignment)
+    {
+        ExpId var_exp = Exp_newVar(IdName);
+        EXP_LOC(var_exp) = loc;
+        getNextToken(); // eat =
+
+        ExpId right = ParseExpression();
+        if (right == EXP_NONE)
+        {
+            compileError("expected expression");
+        }
+        return CheckAssignment(var_exp, right, loc);
+    }
+
+    getNextToken(); // eat (
+
+    ExpId *args = NULL;
+    size_t length = 0;
+    size_t allocated = 0;
+    if (Ctx->CurTok != ')')
+    {
+        while (1)
+        {
+            ExpId arg = ParseExpression();
+            if (arg != EXP_NONE)
+            {
+                VEC_PUSH(args, length, allocated, arg);
+            }
+            else
+            {
+                free(args);
+                return EXP_NONE;
+            }
+
+            if (Ctx->CurTok == ')')
+            {
+                break;
+            }
+
+            if (Ctx->CurTok != ',')
+            {
+                compileError("Expected ')' or ',' in argument list");
+            }
+
+            getNextToken();
+        }
+    }
+	getNextToken(); // eat ')'
+
+    char *type = NULL;
+    if (isBuiltin(IdName))
+    {
+        CheckBuiltin(IdName, args, length);
+    } else
+    {
+        type = CheckCall(IdName, args, length);
+    }
+	ExpId exp = Exp_newCall(IdName, Exp_list(args, length), length, type);
+    EXP_LOC(exp) = loc;
+    free(args);
+
+    return exp;
+}
+
+// { statements }, collected into one child range like a function body
+static void ParseBlock(uint32_t *list, uint32_t *count)
+{
+    if (Ctx->CurTok != '{')
+    {
+        compileError("expected {");
+    }
+    getNextToken(); // eat {
+
+    ExpId *exprs = NULL;
+    size_t allocated = 0;
+    size_t size = 0;
+    while (Ctx->CurTok != '}')
+    {
+        if (Ctx->CurTok == tok_eof)
+        {
+            compileError("expected }");
+        }
+        ExpId e = ParseExpression();
+        if (e == EXP_NONE)
+            continue;
+
+        VEC_PUSH(exprs, size, allocated, e);
+    }
+    getNextToken(); // eat }
+
+    *list = Exp_list(exprs, size);
+    *count = size;
+    free(exprs);
+}
+
+// if [likely | unlikely] condition { ... } [else { ... } | else if ...]
+// The hint says which way the condition usually goes.
+static ExpId ParseIf()
+{
+    struct SourceLoc loc = CurLoc();
+    getNextToken(); // eat if
+
+    struct ExpIf branch = { .hint = 0 };
+    if (Ctx->CurTok == tok_likely || Ctx->CurTok == tok_unlikely)
+    {
+        branch.hint = Ctx->CurTok == tok_likely ? 1 : -1;
+        getNextToken();
+    }
+
+    branch.cond = ParseExpression();
+    if (branch.cond == EXP_NONE)
+    {
+        compileError("expected condition");
+    }
+    if (strcmp(Exp_getType(branch.cond), "int") != 0)
+    {
+        compileError("condition must be int, got %s", Exp_getType(branch.cond));
+    }
+    ParseBlock(&branch.then, &branch.numThen);
+
+    if (Ctx->CurTok == tok_else)
+    {
+        getNextToken(); // eat else
+        if (Ctx->CurTok == tok_if)
+        {
+            ExpId chained = ParseIf();
+            branch.otherwise = Exp_list(&chained, 1);
+            branch.numOtherwise = 1;
+        } else
+        {
+            ParseBlock(&branch.otherwise, &branch.numOtherwise);
+        }
+    }
+
+    ExpId exp = Exp_newIf(branch);
+    EXP_LOC(exp) = loc;
+    return exp;
+}
+
+static ExpId ParsePrimary()
+{
+    while (true)
+    {
+        switch (Ctx->CurTok)
+        {
+            case ';':
+                getNextToken();
+                return EXP_NONE;
+
+            case '\n':
+                getNextToken();
+                // fall through
+
+            case '\r':
+                getNextToken();
+                // fall through
+
+            case tok_quo:
+            case tok_rawline:
+                return ParseStringLiteral();
+
+            case tok_int:
+                return ParseIntExpr();
+
+            case tok_identifier:
+                return ParseIdentifierExpr();
+
+            case tok_declaration:
+                return ParseDeclaration();
+
+            case tok_return:
+                return ParseReturn();
+
+            case tok_if:
+                return ParseIf();
+
+            default:
+                compileError("unknown token '%c' (%d)", Ctx->CurTok, Ctx->CurTok);
+        }
+    }
+
+    return EXP_NONE;
+}
+
+// Rejects a tree nested deeper than maxNesting(), which the
+// parser alone does not bound: parentheses and comparison chains nest
+// without recursing. Sums don't count, every walk flattens them with
+// Exp_collectTerms.
+static void Exp_checkDepth(ExpId root)
+{
+    struct ExpDepth { ExpId exp; int depth; } *stack = NULL;
+    size_t size = 0;
+    size_t allocated = 0;
+    struct ExpDepth top = { root, 0 };
+    VEC_PUSH(stack, size, allocated, top);
+    while (size > 0)
+    {
+        top = stack[--size];
+        if (top.exp == EXP_NONE)
+        {
+            continue;
+        }
+        if (top.depth > maxNesting())
+        {
+            free(stack);
+            compileError("expression nested too deeply, the limit is %d levels", maxNesting());
+        }
+
+        ExpId children[2] = { EXP_NONE, EXP_NONE };
+        uint32_t list = 0;
+        uint32_t count = 0;
+        uint32_t otherwise = 0;
+        uint32_t numOtherwise = 0;
+        int depth = top.depth + 1;
+        switch (EXP_TAG(top.exp))
+        {
+            case exp_add:
+                children[0] = EXP_ADD(top.exp)->left;
+                children[1] = EXP_ADD(top.exp)->right;
+                depth = top.depth;
+                break;
+            case exp_compare:
+                children[0] = EXP_COMPARE(top.exp)->left;
+                children[1] = EXP_COMPARE(top.exp)->right;
+                break;
+            case exp_assignment:
+                children[0] = EXP_ASSIGNMENT(top.exp)->target;
+                children[1] = EXP_ASSIGNMENT(top.exp)->right;
+                break;
+            case exp_index:
+                children[0] = EXP_INDEX(top.exp)->array;
+                children[1] = EXP_INDEX(top.exp)->index;
+                break;
+            case exp_return:
+                children[0] = EXP_RETURN(top.exp);
+                break;
+            case exp_call:
+                list = EXP_CALL(top.exp)->args;
+                count = EXP_CALL(top.exp)->numArgs;
+                break;
+            case exp_function:
+                list = EXP_FUNCTION(top.exp)->body;
+                count = EXP_FUNCTION(top.exp)->numExprs;
+                break;
+            case exp_if:
+                children[0] = EXP_IF(top.exp)->cond;
+                list = EXP_IF(top.exp)->then;
+                count = EXP_IF(top.exp)->numThen;
+                otherwise = EXP_IF(top.exp)->otherwise;
+                numOtherwise = EXP_IF(top.exp)->numOtherwise;
+                break;
+            default:
+                break;
+        }
+
+        for (int i = 0; i < 2; i++)
+        {
+            struct ExpDepth child = { children[i], depth };
+            VEC_PUSH(stack, size, allocated, child);
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+            struct ExpDepth child = { EXP_CHILD(list, i), depth };
+            VEC_PUSH(stack, size, allocated, child);
+        }
+        for (uint32_t i = 0; i < numOtherwise; i++)
+        {
+            struct ExpDepth child = { EXP_CHILD(otherwise, i), depth };
+            VEC_PUSH(stack, size, allocated, child);
+        }
+    }
+    free(stack);
+}
+
+static void ExpListAppend(ExpId exp)
+{
+    Exp_checkDepth(exp);
+    if (Ctx->options.pipeline)
+    {
+        BatchQueue_add(Ctx->batchQueue, exp);
+        return;
+    }
+    VEC_PUSH(Ctx->Expressions, Ctx->ExpCount, Ctx->ExpAllocated, exp);
+}
+
+static ExpId ParseTopLevelExpr()
+{
+    ExpId e = ParseExpression();
+    if (e != EXP_NONE)
+    {
+        char *protoName = calloc(strlen(AnonExpr), sizeof(char));
+        strlcpy(protoName, AnonExpr, strlen(AnonExpr) * sizeof(char));
+
+        struct ExpFunction fn =
+        {
+            .name = protoName,
+            .params = Nodes->params.size,
+            .numParams = 0,
+            .body = Exp_list(&e, 1),
+            .numExprs = 1
+        };
+        ExpId function = Exp_newFunction(fn);
+        EXP_LOC(function) = EXP_LOC(e);
+        return function;
+    }
+
+    return EXP_NONE;
+}
+
+static void HandleTopLevelExpression()
+{
+    ExpId topLevel = ParseTopLevelExpr();
+    if (topLevel != EXP_NONE)
+    {
+        ExpListAppend(topLevel);
+    } else
+    {
+        getNextToken();
+    }
+}
+
+static void HandleDefinition(bool exposed)
+{
+    ExpId exp = ParseDefinition(exposed);
+    if (exp != EXP_NONE)
+    {
+        ExpListAppend(exp);
+        return;
+    }
+    getNextToken();
+}
+
+static void MainLoop()
+{
+    while (1)
+    {
+        switch(Ctx->CurTok)
+        {
+            case tok_eof:
+                if (Ctx->Depth > 0)
+                {
+                    compileError("Expected }");
+                }
+                return;
+
+            case '{':
+                getNextToken();
+                break;
+
+            case '}':
+                getNextToken();
+                break;
+
+            case ';':
+                getNextToken();
+                break;
+
+            case tok_fn:
+                HandleDefinition(false);
+                break;
+
+            case tok_expose:
+                if (getNextToken() != tok_fn)
+                {
+                    compileError("expected fn after expose");
+                }
+                HandleDefinition(true);
+                break;
+
+            default:
+                HandleTopLevelExpression();
+                break;
+        }
+    }
+}
+
+typedef struct CallGraph
+{
+    struct StrMap functions;  // name -> index into Expressions
+    bool *reachable;      // indexed like Expressions
+    bool *usedLiterals;   // indexed by literal id
+    bool usedRuntime[NUM_BUILTINS];
+    bool usesArena;
+    bool usesBounds;
+    bool usesArrayAlloc;
+    int *worklist;
+    int worklistSize;
+} CallGraph;
+
+static int FindFunction(char *name)
+{
+    long *idx = StrMap_get(&Ctx->callGraph->functions, name);
+    return idx == NULL ? -1 : *idx;
+}
+
+static void CallGraph_markFunction(int idx)
+{
+    if (idx < 0 || Ctx->callGraph->reachable[idx])
+    {
+        return;
+    }
+    Ctx->callGraph->reachable[idx] = true;
+    Ctx->callGraph->worklist[Ctx->callGraph->worklistSize++] = idx;
+}
+
+// Marks what the tree under root uses. The walk keeps its own stack.
+static void CallGraph_visit(ExpId root)
+{
+    ExpId *stack = NULL;
+    size_t size = 0;
+    size_t allocated = 0;
+    VEC_PUSH(stack, size, allocated, root);
+    while (size > 0)
+    {
+        ExpId exp = stack[--size];
+        if (exp == EXP_NONE)
+        {
+            continue;
+        }
+
+        switch (EXP_TAG(exp))
+        {
+            case exp_function:
+            {
+                struct ExpFunction *fn = EXP_FUNCTION(exp);
+                for (uint32_t i = 0; i < fn->numExprs; i++)
+                {
+                    VEC_PUSH(stack, size, allocated, EXP_CHILD(fn->body, i));
+                }
+                break;
+            }
+
+            case exp_assignment:
+                VEC_PUSH(stack, size, allocated, EXP_ASSIGNMENT(exp)->target);
+                VEC_PUSH(stack, size, allocated, EXP_ASSIGNMENT(exp)->right);
+                break;
+
+            case exp_add:
+            {
+                if (strcmp(Exp_getType(exp), "string") == 0)
+                {
+                    Ctx->callGraph->usesArena = true;
+                }
+                // the whole tree at once, typed once rather than per node
+                ExpId *terms = NULL;
+                size_t numTerms = 0;
+                size_t termsAllocated = 0;
+                Exp_collectTerms(exp, &terms, &numTerms, &termsAllocated);
+                for (size_t i = 0; i < numTerms; i++)
+                {
+                    VEC_PUSH(stack, size, allocated, terms[i]);
+                }
+                free(terms);
+                break;
+            }
+
+            case exp_stringlit:
+                Ctx->callGraph->usedLiterals[EXP_STRINGLIT(exp)] = true;
+                break;
+
+            case exp_return:
+                VEC_PUSH(stack, size, allocated, EXP_RETURN(exp));
+                break;
+
+            case exp_compare:
+                VEC_PUSH(stack, size, allocated, EXP_COMPARE(exp)->left);
+                VEC_PUSH(stack, size, allocated, EXP_COMPARE(exp)->right);
+                break;
+
+            case exp_if:
+            {
+                struct ExpIf *branch = EXP_IF(exp);
+                VEC_PUSH(stack, size, allocated, branch->cond);
+                for (uint32_t i = 0; i < branch->numThen; i++)
+                {
+                    VEC_PUSH(stack, size, allocated, EXP_CHILD(branch->then, i));
+                }
+                for (uint32_t i = 0; i < branch->numOtherwise; i++)
+                {
+                    VEC_PUSH(stack, size, allocated, EXP_CHILD(branch->otherwise, i));
+                }
+                break;
+            }
+
+            case exp_declaration:
+                if (arrayLength(EXP_DECLARATION(exp)->type) * 4 > ARRAY_STACK_MAX)
+                {
+                    Ctx->callGraph->usesArrayAlloc = true;
+                }
+                break;
+
+            case exp_index:
+                Ctx->callGraph->usesBounds = true;
+                VEC_PUSH(stack, size, allocated, EXP_INDEX(exp)->array);
+                VEC_PUSH(stack, size, allocated, EXP_INDEX(exp)->index);
+                break;
+
+            case exp_call:
+            {
+                struct ExpCall *call = EXP_CALL(exp);
+                for (uint32_t i = 0; i < call->numArgs; i++)
+                {
+                    VEC_PUSH(stack, size, allocated, EXP_CHILD(call->args, i));
+                }
+
+                bool builtin = false;
+                for (size_t i = 0; i < NUM_BUILTINS && !builtin; i++)
+                {
+                    if (strcmp(Builtins[i].name, call->callee) == 0)
+                    {
+                        Ctx->callGraph->usedRuntime[i] = true;
+                        builtin = true;
+                    }
+                }
+                if (!builtin)
+                {
+                    CallGraph_markFunction(FindFunction(call->callee));
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+    free(stack);
+}
+
+// Marks everything reachable from entry. Without --whole-program every
+// function and literal is considered used.
+static void CallGraph_build()
+{
+    Ctx->callGraph->reachable = calloc(Ctx->ExpCount + 1, sizeof(bool));
+    Ctx->callGraph->usedLiterals = calloc(Ctx->curLit + 1, sizeof(bool));
+    Ctx->callGraph->worklist = malloc(sizeof(int) * (Ctx->ExpCount + 1));
+    Ctx->callGraph->worklistSize = 0;
+    if (Ctx->callGraph->reachable == NULL || Ctx->callGraph->usedLiterals == NULL || Ctx->callGraph->worklist == NULL)
+    {
+        compileError("error allocating memory");
+    }
+
+    if (!Ctx->options.wholeProgram)
+    {
+        memset(Ctx->callGraph->reachable, true, Ctx->ExpCount);
+        memset(Ctx->callGraph->usedLiterals, true, Ctx->curLit);
+        return;
+    }
+
+    for (int i = Ctx->ExpCount - 1; i >= 0; i--)
+    {
+        ExpId exp = Ctx->Expressions[i];
+        if (EXP_TAG(exp) == exp_function)
+        {
+            StrMap_set(&Ctx->callGraph->functions, EXP_FUNCTION(exp)->name, i);
+        }
+    }
+
+    int entry = FindFunction("entry");
+    if (entry < 0)
+    {
+        compileError("whole program mode needs an entry function");
+    }
+    CallGraph_markFunction(entry);
+
+    while (Ctx->callGraph->worklistSize > 0)
+    {
+        int idx = Ctx->callGraph->worklist[--Ctx->callGraph->worklistSize];
+        CallGraph_visit(Ctx->Expressions[idx]);
+    }
+}
+
+static void CallGraph_free()
+{
+    StrMap_free(&Ctx->callGraph->functions);
+    free(Ctx->callGraph->reachable);
+    free(Ctx->callGraph->usedLiterals);
+    free(Ctx->callGraph->worklist);
+    *Ctx->callGraph = (struct CallGraph) { .reachable = NULL };
+}
+
+typedef struct RuntimeModules
+{
+    char **names;
+    size_t size;
+    size_t allocated;
+} RuntimeModules;
+
+// Under --instrument a module in stdlib/instrument replaces the one in
+// stdlib: those builds count their calls for the profile, so the plain
+// runtime carries no counters.
+static char *readStdlibFile(char *name)
+{
+    size_t pathLen = strlen(Ctx->options.stdlibDir) + strlen("/instrument/") + strlen(name) + 3;
+    char *path = malloc(pathLen);
+    if (path == NULL)
+    {
+        compileError("error allocating memory");
+    }
+
+    char *text = NULL;
+    if (Ctx->options.instrument)
+    {
+        snprintf(path, pathLen, "%s/instrument/%s.q", Ctx->options.stdlibDir, name);
+        text = readFile(path, NULL);
+    }
+    if (text == NULL)
+    {
+        snprintf(path, pathLen, "%s/%s.q", Ctx->options.stdlibDir, name);
+        text = readFile(path, NULL);
+    }
+    free(path);
+    return text;
+}
+
+static bool Runtime_emitted(char *name)
+{
+    for (size_t i = 0; i < Ctx->emittedRuntime->size; i++)
+    {
+        if (strcmp(Ctx->emittedRuntime->names[i], name) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copies stdlib/<name>.q into the module without its export so QBE sees
+// it as a local function, then pulls in every stdlib function it calls.
+// Callees without a stdlib file (libc) are left to the linker.
+static void Runtime_emit(char *name)
+{
+    if (Runtime_emitted(name))
+    {
+        return;
+    }
+
+    char *text = readStdlibFile(name);
+    if (text == NULL)
+    {
+        return;
+    }
+
+    VEC_PUSH(Ctx->emittedRuntime->names, Ctx->emittedRuntime->size, Ctx->emittedRuntime->allocated, copyString(name));
+
+    char *export = "export ";
+    size_t exportLen = strlen(export);
+    for (char *line = text; *line != '\0'; )
+    {
+        char *end = strchr(line, '\n');
+        size_t len = end == NULL ? strlen(line) : (size_t)(end - line) + 1;
+        if (strncmp(line, export, exportLen) == 0)
+        {
+            fprintf(Ctx->out, "%.*s", (int)(len - exportLen), line + exportLen);
+        } else
+        {
+            fprintf(Ctx->out, "%.*s", (int)len, line);
+        }
+        line += len;
+    }
+    if (text[0] != '\0' && text[strlen(text) - 1] != '\n')
+    {
+        fputc('\n', Ctx->out);
+    }
+
+    for (char *call = strstr(text, "call $"); call != NULL; call = strstr(call, "call $"))
+    {
+        call += strlen("call $");
+        size_t len = 0;
+        while (isalnum(call[len]) || call[len] == '_')
+        {
+            len++;
+        }
+
+        char *callee = malloc(len + 1);
+        strlcpy(callee, call, len + 1);
+        Runtime_emit(callee);
+        free(callee);
+    }
+
+    free(text);
+}
+
+static void Runtime_emitUsed()
+{
+    for (size_t i = 0; i < NUM_BUILTINS; i++)
+    {
+        if (Ctx->callGraph->usedRuntime[i])
+        {
+            Runtime_emit(Builtins[i].runtime);
+        }
+    }
+
+    if (Ctx->callGraph->usesArena)
+    {
+        Runtime_emit("arena_alloc");
+    }
+
+    if (Ctx->callGraph->usesBounds)
+    {
+        Runtime_emit("bounds_fail");
+    }
+
+    if (Ctx->callGraph->usesArrayAlloc)
+    {
+        Runtime_emit("array_alloc");
+    }
+
+    // prof_dump reads the counters of all three
+    if (Ctx->options.instrument)
+    {
+        Runtime_emit("prof_init");
+        Runtime_emit("prof_clock");
+        Runtime_emit("dputs");
+        Runtime_emit("itos");
+        Runtime_emit("arena_alloc");
+    }
+}
+
+static int compareEmitOrder(const void *a, const void *b)
+{
+    int l = *(const int *)a;
+    int r = *(const int *)b;
+    if (Ctx->emitCounts[l] != Ctx->emitCounts[r])
+    {
+        return Ctx->emitCounts[l] < Ctx->emitCounts[r] ? 1 : -1;
+    }
+    return l - r;
+}
+
+// Indices into Expressions in the order they are emitted: source order,
+// or hottest first with never called functions last under --profile-use.
+static int *emitOrder()
+{
+    int *order = malloc(sizeof(int) * (Ctx->ExpCount + 1));
+    if (order == NULL)
+    {
+        compileError("error allocating memory");
+    }
+    for (int i = 0; i < Ctx->ExpCount; i++)
+    {
+        order[i] = i;
+    }
+
+    if (!Ctx->profile->loaded)
+    {
+        return order;
+    }
+
+    Ctx->emitCounts = malloc(sizeof(long) * (Ctx->ExpCount + 1));
+    if (Ctx->emitCounts == NULL)
+    {
+        compileError("error allocating memory");
+    }
+    for (int i = 0; i < Ctx->ExpCount; i++)
+    {
+        ExpId exp = Ctx->Expressions[i];
+        Ctx->emitCounts[i] = EXP_TAG(exp) == exp_function ? Profile_count(EXP_FUNCTION(exp)->name) : 0;
+    }
+    qsort(order, Ctx->ExpCount, sizeof(int), compareEmitOrder);
+    free(Ctx->emitCounts);
+    Ctx->emitCounts = NULL;
+    return order;
+}
+
+// Ctx->out is a stdio stream over the caller's sink
+static ssize_t Funcoc_write(void *cookie, const char *data, size_t len)
+{
+    struct Funcoc *ctx = cookie;
+    ctx->sink(data, len, ctx->sinkUser);
+    return len;
+}
+
+// Compiles Ctx->Source, the body of Funcoc_compile. Errors unwind from
+// anywhere inside through compileError.
+static void Funcoc_run()
+{
+    // the runtime is QBE source, so with x86 it is linked as objects instead
+    if (Ctx->options.wholeProgram && Ctx->options.backend == backend_x86)
+    {
+        compileError("--whole-program needs --backend qbe");
+    }
+
+    // both need every function parsed before the first is emitted
+    if (Ctx->options.pipeline && (Ctx->options.wholeProgram || Ctx->options.profilePath != NULL))
+    {
+        compileError("--pipeline cannot be used with --whole-program or --profile-use");
+    }
+
+    if (Ctx->options.profilePath != NULL)
+    {
+        Profile_load(Ctx->options.profilePath);
+    }
+    for (int i = 0; i < Ctx->options.numImports; i++)
+    {
+        Interface_import(Ctx->options.imports[i]);
+    }
+
+    if (Ctx->options.pipeline)
+    {
+        TokenRing_start(Ctx->tokenRing);
+        BatchQueue_start(Ctx->batchQueue);
+    } else
+    {
+        lexSource();
+    }
+    getNextToken();
+
+    MainLoop();
+
+    if (Ctx->options.pipeline)
+    {
+        BatchQueue_finish(Ctx->batchQueue);
+        pthread_join(Ctx->tokenRing->thread, NULL);
+        Ctx->lexerStarted = false;
+        checkFailed();
+    }
+
+    CallGraph_build();
+
+    if (Ctx->options.debugInfo)
+    {
+        fprintf(Ctx->out, Ctx->options.backend == backend_x86 ? ".file 1 \"%s\"\n" : "dbgfile \"%s\"\n", Ctx->name);
+    }
+
+    for (int i = 0; i < Ctx->curLit; i++)
+    {
+        struct StringLiteral *lit = &Ctx->stringLiterals[i];
+        if (!Ctx->callGraph->usedLiterals[i])
+        {
+            continue;
+        }
+
+        // strings are length-prefixed so the runtime never scans for a NUL
+        size_t len = lit->length;
+        if (Ctx->options.ilStats != NULL)
+        {
+            IlStats_data(8 + len);
+        }
+        char sym[16];
+        snprintf(sym, sizeof(sym), "sl%d", i);
+        struct DataWriter data = Data_begin(Ctx->out, sym);
+        Data_long(&data, len);
+        if (len != 0)
+        {
+            Data_bytes(&data, lit->bytes, len);
+        }
+        Data_end(&data);
+    }
+
+    Profile_findInlinable();
+    int *order = emitOrder();
+    for (int i = 0; i < Ctx->ExpCount; i++)
+    {
+        int idx = order[i];
+        if (Ctx->callGraph->reachable[idx])
+        {
+            Exp_toIL(Ctx->Expressions[idx]);
+        }
+    }
+    free(order);
+
+    if (Ctx->options.pipeline)
+    {
+        BatchQueue_print(Ctx->batchQueue);
+    }
+
+    if (Ctx->options.wholeProgram)
+    {
+        Runtime_emitUsed();
+    }
+
+    if (Ctx->options.instrument)
+    {
+        Il_printProfileTable();
+    }
+    if (Ctx->options.backend == backend_x86)
+    {
+        fprintf(Ctx->out, ".section .note.GNU-stack,\"\",@progbits\n");
+    }
+
+    if (Ctx->options.interfacePath != NULL)
+    {
+        Interface_write(Ctx->options.interfacePath, Ctx->name);
+    }
+
+    if (Ctx->options.ilStats != NULL)
+    {
+        IlStats_report(Ctx->options.ilStats);
+    }
+}
+
+// Stops the pipeline threads and frees what the compilation built, after
+// it succeeded or failed part way, leaving Ctx ready for the next one.
+// Strings the parser or codegen held in locals when an error unwound
+// them are not reclaimed.
+static void Funcoc_release()
+{
+    atomic_store(&Ctx->failed, true);
+    BatchQueue_stop(Ctx->batchQueue);
+    if (Ctx->lexerStarted)
+    {
+        pthread_join(Ctx->tokenRing->thread, NULL);
+        Ctx->lexerStarted = false;
+    }
+    if (Ctx->tokenRing != NULL)
+    {
+        TokenBuffer_free(&Ctx->tokenRing->block);
+    }
+
+    if (Ctx->CurFn != NULL)
+    {
+        IlFunction_free(Ctx->CurFn);
+        free(Ctx->CurFn);
+        Ctx->CurFn = NULL;
+    }
+    Ctx->CurFnName = NULL;
+
+    for (int i = 0; i < Ctx->curLit; i++)
+    {
+        if (Ctx->stringLiterals[i].owned)
+        {
+            free((char *)Ctx->stringLiterals[i].bytes);
+        }
+    }
+    free(Ctx->stringLiterals);
+    Ctx->stringLiterals = NULL;
+    Ctx->curLit = 0;
+    Ctx->literalsAllocated = 0;
+
+    free(Ctx->Expressions);
+    Ctx->Expressions = NULL;
+    Ctx->ExpCount = 0;
+    Ctx->ExpAllocated = 0;
+    Ast_free(Ctx->Tree);
+    free(Ctx->operands);
+    free(Ctx->operators);
+    Ctx->operands = NULL;
+    Ctx->operators = NULL;
+    Ctx->numOperands = Ctx->operandsAllocated = 0;
+    Ctx->numOperators = Ctx->operatorsAllocated = 0;
+    VarRefMap_free(&Ctx->varMap);
+    TokenBuffer_free(&Ctx->Tokens);
+
+    Interfaces_free();
+    Signatures_free();
+    StrMap_free(&Ctx->profile->counts);
+    StrMap_free(&Ctx->profile->inlinable);
+    *Ctx->profile = (struct Profile) { .loaded = false };
+    for (size_t i = 0; i < Ctx->profiled->size; i++)
+    {
+        free(Ctx->profiled->names[i]);
+    }
+    free(Ctx->profiled->names);
+    *Ctx->profiled = (struct ProfiledFunctions) { .names = NULL, .size = 0, .allocated = 0 };
+    CallGraph_free();
+    for (size_t i = 0; i < Ctx->emittedRuntime->size; i++)
+    {
+        free(Ctx->emittedRuntime->names[i]);
+    }
+    free(Ctx->emittedRuntime->names);
+    *Ctx->emittedRuntime = (struct RuntimeModules) { .names = NULL, .size = 0, .allocated = 0 };
+    free(Ctx->emitCounts);
+    Ctx->emitCounts = NULL;
+
+    IlCallCounts_free(&Ctx->ilStats->calls);
+    *Ctx->ilStats = (struct IlStats) { .functions = 0 };
+    memset(Ctx->PeepholeHits, 0, sizeof(size_t) * NUM_PEEPHOLE_RULES);
+
+    Ctx->Source = NULL;
+    Ctx->SourceLen = 0;
+    Ctx->CurToken = (struct LexToken) { .kind = 0 };
+    Ctx->CurTok = 0;
+    Ctx->CurIdx = -1;
+    Ctx->IdentifierStr = NULL;
+    Ctx->NumVal = 0;
+    Ctx->Depth = 0;
+    Ctx->nesting = 0;
+    Ctx->inlineArgs = NULL;
+    Ctx->CurSignature = -1;
+}
+
+struct Funcoc *Funcoc_new(const struct FuncocOptions *options)
+{
+    struct Funcoc *ctx = calloc(1, sizeof(struct Funcoc));
+    if (ctx == NULL)
     {
-        free(argNames);
         return NULL;
     }
-    expr->name = fnName;
-    expr->args = argNames;
-    expr->numArgs = idx;
-    
-    return expr;
+    ctx->options = *options;
+    if (ctx->options.stdlibDir == NULL)
+    {
+        ctx->options.stdlibDir = "stdlib";
+    }
+    ctx->CurIdx = -1;
+    ctx->CurSignature = -1;
+    pthread_mutex_init(&ctx->errorLock, NULL);
+    pthread_mutex_init(&ctx->literalsLock, NULL);
+
+    ctx->Tree = calloc(1, sizeof(struct Ast));
+    ctx->batchQueue = calloc(1, sizeof(struct BatchQueue));
+    ctx->interfaces = calloc(1, sizeof(struct Interfaces));
+    ctx->profile = calloc(1, sizeof(struct Profile));
+    ctx->profiled = calloc(1, sizeof(struct ProfiledFunctions));
+    ctx->callGraph = calloc(1, sizeof(struct CallGraph));
+    ctx->signatures = calloc(1, sizeof(struct Signatures));
+    ctx->emittedRuntime = calloc(1, sizeof(struct RuntimeModules));
+    ctx->ExpTagCounts = calloc(NUM_EXP_TAGS, sizeof(size_t));
+    ctx->PeepholeHits = calloc(NUM_PEEPHOLE_RULES, sizeof(size_t));
+    ctx->ilStats = calloc(1, sizeof(struct IlStats));
+    // the ring is large and only the pipeline uses it
+    if (ctx->options.pipeline)
+    {
+        ctx->tokenRing = calloc(1, sizeof(struct TokenRing));
+    }
+    if ((ctx->options.pipeline && ctx->tokenRing == NULL) || ctx->Tree == NULL || ctx->batchQueue == NULL || ctx->interfaces == NULL
+        || ctx->profile == NULL || ctx->profiled == NULL || ctx->callGraph == NULL || ctx->signatures == NULL || ctx->emittedRuntime == NULL
+        || ctx->ExpTagCounts == NULL || ctx->PeepholeHits == NULL || ctx->ilStats == NULL)
+    {
+        Funcoc_free(ctx);
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->batchQueue->lock, NULL);
+    pthread_cond_init(&ctx->batchQueue->ready, NULL);
+    return ctx;
+}
+
+int Funcoc_compile(struct Funcoc *ctx, const char *name, const char *source, size_t len, FuncocSink sink, void *user)
+{
+    cookie_io_functions_t io = { .write = Funcoc_write };
+    ctx->error[0] = '\0';
+    atomic_store(&ctx->failed, false);
+    ctx->sink = sink;
+    ctx->sinkUser = user;
+    ctx->out = fopencookie(ctx, "w", io);
+    if (ctx->out == NULL)
+    {
+        snprintf(ctx->error, sizeof(ctx->error), "error allocating memory");
+        return -1;
+    }
+    ctx->CodeOut = ctx->out;
+    ctx->name = name;
+    ctx->Source = source;
+    ctx->SourceLen = len;
+
+    jmp_buf onError;
+    Ctx = ctx;
+    ErrorJump = &onError;
+    Nodes = ctx->Tree;
+    int status = 0;
+    if (setjmp(onError) == 0)
+    {
+        Funcoc_run();
+    } else
+    {
+        status = -1;
+    }
+
+    Funcoc_release();
+    fclose(ctx->out);
+    ctx->out = NULL;
+    ctx->CodeOut = NULL;
+    Ctx = NULL;
+    ErrorJump = NULL;
+    Nodes = NULL;
+    return status;
+}
+
+const char *Funcoc_error(struct Funcoc *ctx)
+{
+    return ctx->error;
+}
+
+void Funcoc_free(struct Funcoc *ctx)
+{
+    if (ctx == NULL)
+    {
+        return;
+    }
+    pthread_mutex_destroy(&ctx->errorLock);
+    pthread_mutex_destroy(&ctx->literalsLock);
+    if (ctx->batchQueue != NULL)
+    {
+        pthread_mutex_destroy(&ctx->batchQueue->lock);
+        pthread_cond_destroy(&ctx->batchQueue->ready);
+    }
+    free(ctx->tokenRing);
+    free(ctx->Tree);
+    free(ctx->batchQueue);
+    free(ctx->interfaces);
+    free(ctx->profile);
+    free(ctx->profiled);
+    free(ctx->callGraph);
+    free(ctx->signatures);
+    free(ctx->emittedRuntime);
+    free(ctx->ExpTagCounts);
+    free(ctx->PeepholeHits);
+    free(ctx->ilStats);
+    free(ctx);
+}
+
+#ifndef FUNCOC_NO_MAIN
+static int AllocSite_compare(const void *a, const void *b)
+{
+    const struct AllocSite *l = a;
+    const struct AllocSite *r = b;
+    if (l->bytes == r->bytes)
+    {
+        return 0;
+    }
+    return l->bytes < r->bytes ? 1 : -1;
+}
+
+static long readProcStatusKb(const char *field)
+{
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status == NULL)
+    {
+        return -1;
+    }
+
+    char line[256];
+    size_t fieldLen = strlen(field);
+    long kb = -1;
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        if (strncmp(line, field, fieldLen) == 0 && line[fieldLen] == ':')
+        {
+            kb = strtol(line + fieldLen + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(status);
+    return kb;
+}
+
+static void Stats_report(struct Funcoc *ctx, FILE *out)
+{
+    fprintf(out, "allocations:   %zu\n", allocStats.allocs);
+    fprintf(out, "reallocations: %zu\n", allocStats.reallocs);
+    fprintf(out, "frees:         %zu\n", allocStats.frees);
+    fprintf(out, "total bytes:   %zu\n", allocStats.totalBytes);
+    fprintf(out, "live bytes:    %zu\n", allocStats.liveBytes);
+    fprintf(out, "peak bytes:    %zu\n", allocStats.peakBytes);
+
+    pthread_mutex_lock(&allocStatsLock);
+    qsort(allocStats.sites, allocStats.numSites, sizeof(struct AllocSite), AllocSite_compare);
+    fprintf(out, "\n%-24s %10s %10s %10s %12s\n", "site", "allocs", "reallocs", "frees", "bytes");
+    for (size_t i = 0; i < allocStats.numSites; i++)
+    {
+        struct AllocSite site = allocStats.sites[i];
+        fprintf(out, "%-24s %10zu %10zu %10zu %12zu\n",
+                site.name, site.allocs, site.reallocs, site.frees, site.bytes);
+    }
+    if (allocStats.untracked > 0)
+    {
+        fprintf(out, "%zu calls not attributed to a site (out of memory)\n", allocStats.untracked);
+    }
+    pthread_mutex_unlock(&allocStatsLock);
+
+    fprintf(out, "\n%-24s %10s\n", "ast node", "count");
+    for (size_t i = 0; i < NUM_EXP_TAGS; i++)
+    {
+        fprintf(out, "%-24s %10zu\n", ExpTagNames[i], ctx->ExpTagCounts[i]);
+    }
+    if (ctx->astNodes > 0)
+    {
+        fprintf(out, "ast bytes:     %zu (%.1f per node)\n", ctx->astBytes, (double)ctx->astBytes / ctx->astNodes);
+    }
+
+    long rss = readProcStatusKb("VmRSS");
+    long hwm = readProcStatusKb("VmHWM");
+    if (hwm < 0)
+    {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+        {
+            hwm = usage.ru_maxrss;
+        }
+    }
+    fprintf(out, "\nrss:           %ld kB\n", rss);
+    fprintf(out, "peak rss:      %ld kB\n", hwm);
+}
+
+static void usage(char *name)
+{
+    printf("usage: %s [--stats] [--il-stats] [--instrument] [--profile-use file] [--whole-program] [--stdlib dir] [--lex-threads n] [--max-nesting n] [--backend qbe|x86] [--pipeline] [-g] [--import file.fci] [--emit-interface file.fci] [-c] [-o file] file\n", name);
+    exit(-1);
+}
+
+static void writeStream(const char *data, size_t len, void *user)
+{
+    fwrite(data, 1, len, user);
 }
 
+// -c and -o run the rest of the toolchain as child processes. The output
+// is streamed into qbe (skipped for --backend x86), which pipes into the
+// assembler, or into cc when linking, so nothing is written to disk
+// before the object or executable. The tools are $QBE, $AS and $CC, or
+// qbe, as and cc from PATH.
+//
+// SIGPIPE is ignored once a tool runs: a stage that exits before reading
+// all of its input makes the writes fail with EPIPE instead of killing
+// the compiler, and the failure is reported with the stage's exit status.
+#define DRIVER_MAX_STAGES 2
+#define DRIVER_FAILURE_MAX 256
+
+typedef struct Driver
+{
+    FILE *in;       // feeds the first stage
+    bool inputFailed; // not all of the input reached the first stage
+    pid_t pids[DRIVER_MAX_STAGES];
+    const char *names[DRIVER_MAX_STAGES];
+    int numStages;
+} Driver;
+
+static const char *Driver_tool(const char *env, const char *name)
+{
+    const char *tool = getenv(env);
+    return tool != NULL && tool[0] != '\0' ? tool : name;
+}
 
-void expect(char expect)
+// kills the stages started so far and reaps them
+static void Driver_stop(struct Driver *driver)
 {
-    getNextToken();
-    if (CurTok != expect)
+    for (int i = 0; i < driver->numStages; i++)
     {
-        printf("expected: %c got: %c", expect, CurTok);
-        exit(-1);
+        kill(driver->pids[i], SIGTERM);
+    }
+    for (int i = 0; i < driver->numStages; i++)
+    {
+        while (waitpid(driver->pids[i], NULL, 0) < 0 && errno == EINTR)
+        {
+        }
     }
+    driver->numStages = 0;
 }
 
-static Exp *ParseDefinition()
+// Starts argv with the given stdin and stdout, closing both in the parent
+static void Driver_spawn(struct Driver *driver, char **argv, int in, int out)
 {
-    getNextToken(); // eat fn.
-    struct exp_prototype *proto = ParsePrototype();
-
-    if (proto == NULL)
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    if (out >= 0)
     {
-        return NULL;
+        posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
     }
-
-    Exp **exprs = malloc(sizeof(struct Exp *));
-    size_t allocated = 1;
-    size_t size = 0;
-    while (CurTok != '}')
+    // the tools get the default SIGPIPE back rather than our SIG_IGN
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+    extern char **environ;
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], &actions, &attributes, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    close(in);
+    if (out >= 0)
     {
-        Exp *e = ParseExpression();
-        if (e == NULL)
-            continue;
-
-        if (size + 1 > allocated) {
-            Exp **temp = realloc(exprs, (size + 1) * sizeof(struct Exp *));
-            if (temp == NULL)
-            {
-                printf("error allocating memory.");
-                free(exprs);
-                exit(-1);
-            }
-            exprs = temp;
-            allocated++;
-        }
-        exprs[size++] = e;
+        close(out);
     }
-
-    exp_body *body = malloc(sizeof(struct exp_body));
-    if (body == NULL)
+    if (error != 0)
     {
-        printf("error allocating memory");
-        for (int i = 0; i < size; i++)
+        if (driver->in != NULL)
         {
-            Exp_Free(exprs[i]);
+            fclose(driver->in);
         }
-        free(exprs);
-        free(proto);
+        Driver_stop(driver);
+        printf("could not run %s", argv[0]);
         exit(-1);
     }
-    body->exprs = exprs;
-    body->numExprs = size;
-    struct Exp *expr = EXP_NEW(exp_function, proto, body);
-    return expr;
 
-    return NULL;
+    driver->pids[driver->numStages] = pid;
+    driver->names[driver->numStages] = argv[0];
+    driver->numStages++;
 }
 
-static Exp *ParseIdentifierExpr()
+// Starts qbe, when the input is IL, piped into last. The pipes are
+// close-on-exec so each child only holds its own ends.
+static void Driver_start(struct Driver *driver, bool il, char **last)
 {
-    char *IdName = IdentifierStr;
-    getNextToken();
-
-    if (CurTok != '(' && CurTok != tok_assignment) // simple variable ref
+    signal(SIGPIPE, SIG_IGN);
+    int input[2];
+    if (pipe2(input, O_CLOEXEC) != 0)
     {
-        return EXP_NEW(exp_var, IdName);
+        printf("could not create pipe");
+        exit(-1);
     }
-
-    if (CurTok == tok_assignment)
+    driver->numStages = 0;
+    driver->inputFailed = false;
+    driver->in = fdopen(input[1], "w");
+    if (driver->in == NULL)
     {
-        Exp *var_exp = EXP_NEW(exp_var, IdName);
-        getNextToken(); // eat =
+        printf("error allocating memory");
+        exit(-1);
+    }
 
-        Exp *right = ParseExpression();
-        if (right == NULL)
+    int next = input[0];
+    if (il)
+    {
+        int assembly[2];
+        if (pipe2(assembly, O_CLOEXEC) != 0)
         {
-            printf("expected expression");
+            printf("could not create pipe");
             exit(-1);
         }
-        return EXP_NEW(exp_assignment, var_exp, right);
+        char *qbe[] = { (char *)Driver_tool("QBE", "qbe"), NULL };
+        Driver_spawn(driver, qbe, next, assembly[1]);
+        next = assembly[0];
     }
+    Driver_spawn(driver, last, next, -1);
+}
 
-    getNextToken(); // eat (
+// closes the input, remembering whether any write to it failed
+static void Driver_close(struct Driver *driver)
+{
+    bool failed = ferror(driver->in) != 0;
+    if (fclose(driver->in) != 0)
+    {
+        failed = true;
+    }
+    driver->in = NULL;
+    driver->inputFailed = failed;
+}
 
-    Exp **args = malloc(sizeof(Exp *));
-    size_t length = 0;
-    size_t allocated = 1;
-    if (CurTok != ')')
+// Waits for every stage, returning false with the first failure described
+// in failure. A stage that exited cleanly without reading all of its
+// input is a failure too.
+static bool Driver_wait(struct Driver *driver, char *failure, size_t size)
+{
+    bool ok = true;
+    for (int i = 0; i < driver->numStages; i++)
     {
-        while (1)
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(driver->pids[i], &status, 0)) < 0 && errno == EINTR)
         {
-            Exp *arg = ParseExpression();
-            if (arg != NULL)
-            {
-                if (allocated < length + 1)
-                {
-                    Exp **temp = realloc(args, (length + 1) * sizeof(Exp *));
-                    if (temp == NULL)
-                    {
-                        printf("error allocating memory.");
-                        free(args);
-                        exit(-1);
-                    }
-                    args = temp;
-                }
-                args[length++] = arg;
-                allocated++;
-            }
-            else
+        }
+        if (pid >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        {
+            continue;
+        }
+        if (ok)
+        {
+            if (pid < 0)
             {
-                free(args);
-                return NULL;
-            }
-
-            if (CurTok == ')')
+                snprintf(failure, size, "could not wait for %s", driver->names[i]);
+            } else if (WIFSIGNALED(status))
             {
-                break;
-            }
-
-            if (CurTok != ',')
+                snprintf(failure, size, "%s was killed by signal %d", driver->names[i], WTERMSIG(status));
+            } else
             {
-                printf("Expected ')' or ',' in argument list");
-                exit(-1);
+                snprintf(failure, size, "%s exited with status %d", driver->names[i], WEXITSTATUS(status));
             }
-
-            getNextToken();
         }
+        ok = false;
     }
-	getNextToken(); // eat ')'
+    driver->numStages = 0;
+    if (ok && driver->inputFailed)
+    {
+        snprintf(failure, size, "%s did not read all of its input", driver->names[0]);
+        ok = false;
+    }
+    return ok;
+}
 
-	Exp *exp = EXP_NEW(exp_call, IdName, args, length);
+static bool Driver_finish(struct Driver *driver, char *failure, size_t size)
+{
+    Driver_close(driver);
+    return Driver_wait(driver, failure, size);
+}
 
-    return exp;
+// stops the tools before they act on truncated input
+static void Driver_abort(struct Driver *driver)
+{
+    fclose(driver->in);
+    driver->in = NULL;
+    Driver_stop(driver);
 }
 
-static Exp *ParsePrimary()
+// runs a single tool with no input
+static bool Driver_run(char **argv, char *failure, size_t size)
 {
-    while (true)
+    struct Driver driver = { .in = NULL, .inputFailed = false, .numStages = 0 };
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devnull < 0)
     {
-        switch (CurTok)
-        {
-            case '(':
-                return ParseParenExpr();
-
-            case ';':
-                getNextToken();
-                return NULL;
-
-            case '\n':
-                getNextToken();
-
-            case '\r':
-                getNextToken();
-
-            case tok_quo:
-                return ParseStringLiteral();
-
-            case tok_int:
-                return ParseIntExpr();
-
-            case tok_identifier:
-                return ParseIdentifierExpr();
-
-            case tok_declaration:
-                return ParseDeclaration();
-
-            default:
-                printf("%s\n", IdentifierStr);
-                printf("%d\n", CurTok);
-                printf("%c\n", CurTok);
-                printf("unknown token\n");
-                exit(-1);
-        }
+        printf("could not open /dev/null");
+        exit(-1);
     }
-
-    exit(-1);
+    Driver_spawn(&driver, argv, devnull, -1);
+    return Driver_wait(&driver, failure, size);
 }
 
-static Exp **Expressions = {};
-static int ExpCount = 0;
+static int compareNames(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
 
-static void ExpListAppend(Exp **list, Exp *exp)
+// Appends the names of the .q files in path to modules
+static void Driver_listModules(const char *path, char ***modules, size_t *numModules, size_t *modulesAllocated)
 {
-    if (ExpCount == 0)
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        printf("stdlib not found: %s", path);
+        exit(-1);
+    }
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir))
     {
-        Exp **temp = malloc(sizeof(Exp *) * 8);
-        if (temp == NULL)
+        size_t len = strlen(entry->d_name);
+        if (len > 2 && strcmp(entry->d_name + len - 2, ".q") == 0)
         {
-            printf("error allocating memory");
-            exit(-1);
+            char *module = copyString(entry->d_name);
+            module[len - 2] = '\0';
+            VEC_PUSH(*modules, *numModules, *modulesAllocated, module);
         }
-        Expressions = temp;
     }
-
-    Exp **set = Expressions + ExpCount;
-    ExpCount++;
-    *set = exp;
+    closedir(dir);
 }
 
-static Exp *ParseTopLevelExpr()
+// Returns the path of an archive holding every stdlib module compiled to
+// an object, building it on first use. The archive is cached under
+// $XDG_CACHE_HOME/funcoc (or ~/.cache/funcoc), named by a hash of the
+// modules' names and contents so an edited stdlib gets a fresh one, and
+// the linker only pulls in the members the program calls. With
+// instrument the modules in stdlib/instrument replace or join the others.
+static char *Driver_runtimeArchive(const char *stdlibDir, bool instrument)
 {
-    Exp *e = ParseExpression();
-    if (e != NULL)
+    char **modules = NULL;
+    size_t numModules = 0;
+    size_t modulesAllocated = 0;
+    char instrumentDir[PATH_MAX - 64];
+    snprintf(instrumentDir, sizeof(instrumentDir), "%s/instrument", stdlibDir);
+    Driver_listModules(stdlibDir, &modules, &numModules, &modulesAllocated);
+    if (instrument)
     {
-        struct exp_prototype *proto = malloc(sizeof(struct exp_prototype));
-        char *protoName = calloc(strlen(AnonExpr), sizeof(char));
-        strlcpy(protoName, AnonExpr, strlen(AnonExpr) * sizeof(char));
-        proto->name = protoName;
-        proto->numArgs = 0;
-        proto->args = NULL;
+        Driver_listModules(instrumentDir, &modules, &numModules, &modulesAllocated);
+    }
+    qsort(modules, numModules, sizeof(char *), compareNames);
 
-        exp_body *body = malloc(sizeof(struct exp_body));
-        if (body == NULL)
+    // a module in both directories is listed once
+    size_t unique = 0;
+    for (size_t i = 0; i < numModules; i++)
+    {
+        if (unique > 0 && strcmp(modules[unique - 1], modules[i]) == 0)
         {
-            printf("error allocating memory");
-            exit(-1);
+            free(modules[i]);
+            continue;
         }
+        modules[unique++] = modules[i];
+    }
+    numModules = unique;
 
-        Exp **exprs = calloc(1, sizeof(struct Exp *));
-        if (exprs == NULL)
+    char **sources = malloc(sizeof(char *) * (numModules + 1));
+    size_t *lengths = malloc(sizeof(size_t) * (numModules + 1));
+    if (sources == NULL || lengths == NULL)
+    {
+        printf("error allocating memory");
+        exit(-1);
+    }
+    size_t hash = HASH_SEED;
+    for (size_t i = 0; i < numModules; i++)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s.q", instrumentDir, modules[i]);
+        if (!instrument || access(path, R_OK) != 0)
         {
-            printf("error allocating memory");
+            snprintf(path, sizeof(path), "%s/%s.q", stdlibDir, modules[i]);
+        }
+        sources[i] = readFile(path, &lengths[i]);
+        if (sources[i] == NULL)
+        {
+            printf("could not read %s", path);
             exit(-1);
         }
-        exprs[0] = e;
-        body->exprs = exprs;
-        body->numExprs = 1;
-
-        Exp *function = EXP_NEW(exp_function, proto, body);
-        return function;
+        hash = hashBytes(hash, modules[i], strlen(modules[i]) + 1);
+        hash = hashBytes(hash, sources[i], lengths[i] + 1);
     }
 
-    printf("ParseExpression returned null");
-
-    return NULL;
-}
-
-static void HandleTopLevelExpression()
-{
-    Exp *topLevel = ParseTopLevelExpr();
-    if (topLevel != NULL) 
+    // leaves room for the names made inside it
+    char cacheDir[PATH_MAX - 64];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg != NULL && xdg[0] != '\0')
     {
-        ExpListAppend(Expressions, topLevel);
+        snprintf(cacheDir, sizeof(cacheDir), "%s/funcoc", xdg);
+    } else if (home != NULL && home[0] != '\0')
+    {
+        snprintf(cacheDir, sizeof(cacheDir), "%s/.cache/funcoc", home);
     } else
     {
-        getNextToken();
+        snprintf(cacheDir, sizeof(cacheDir), "/tmp/funcoc-%d", (int)getuid());
     }
-}
-
-static void HandleDefinition()
-{
-    struct Exp *exp = ParseDefinition();
-    if (exp != NULL)
+    // mkdir -p, failures show up when the build directory is created
+    for (char *slash = strchr(cacheDir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
     {
-        ExpListAppend(Expressions, exp);
-        return;
+        *slash = '\0';
+        mkdir(cacheDir, 0755);
+        *slash = '/';
     }
-    getNextToken();
-}
+    mkdir(cacheDir, 0755);
 
-static void MainLoop()
-{
-    while (1)
+    char archive[PATH_MAX];
+    snprintf(archive, sizeof(archive), "%s/rt-%016zx.a", cacheDir, hash);
+    if (access(archive, R_OK) == 0)
     {
-        switch(CurTok)
+        for (size_t i = 0; i < numModules; i++)
         {
-            case tok_eof:
-                if (Depth > 0)
-                {
-                    printf("Expected }");
-                    exit(-1);
-                }
-                return;
-
-            case '{':
-                getNextToken();
-                break;
+            free(modules[i]);
+            free(sources[i]);
+        }
+        free(modules);
+        free(sources);
+        free(lengths);
+        return copyString(archive);
+    }
 
-            case '}':
-                getNextToken();
-                break;
+    // built in a private directory and renamed into place, so concurrent
+    // builds never see a partial archive
+    char tmpDir[PATH_MAX - 32];
+    snprintf(tmpDir, sizeof(tmpDir), "%s/build-XXXXXX", cacheDir);
+    if (mkdtemp(tmpDir) == NULL)
+    {
+        printf("could not create %s", tmpDir);
+        exit(-1);
+    }
 
-            case ';':
-                getNextToken();
-                break;
+    // the modules are independent, so all of them compile at once
+    struct Driver *drivers = malloc(sizeof(struct Driver) * (numModules + 1));
+    char **objects = malloc(sizeof(char *) * (numModules + 1));
+    if (drivers == NULL || objects == NULL)
+    {
+        printf("error allocating memory");
+        exit(-1);
+    }
+    for (size_t i = 0; i < numModules; i++)
+    {
+        char object[PATH_MAX];
+        snprintf(object, sizeof(object), "%s/%s.o", tmpDir, modules[i]);
+        objects[i] = copyString(object);
+        char *as[] = { (char *)Driver_tool("AS", "as"), "-o", objects[i], NULL };
+        Driver_start(&drivers[i], true, as);
+    }
+    for (size_t i = 0; i < numModules; i++)
+    {
+        fwrite(sources[i], 1, lengths[i], drivers[i].in);
+        Driver_close(&drivers[i]);
+    }
+    char failure[DRIVER_FAILURE_MAX];
+    bool ok = true;
+    for (size_t i = 0; i < numModules; i++)
+    {
+        char stage[DRIVER_FAILURE_MAX];
+        if (!Driver_wait(&drivers[i], stage, sizeof(stage)) && ok)
+        {
+            strlcpy(failure, stage, sizeof(failure));
+            ok = false;
+        }
+    }
 
-            case tok_fn:
-                HandleDefinition();
-                break;
+    char tmpArchive[PATH_MAX];
+    snprintf(tmpArchive, sizeof(tmpArchive), "%s/rt.a", tmpDir);
+    if (ok)
+    {
+        char **ar = malloc(sizeof(char *) * (numModules + 4));
+        if (ar == NULL)
+        {
+            printf("error allocating memory");
+            exit(-1);
+        }
+        ar[0] = (char *)Driver_tool("AR", "ar");
+        ar[1] = "rcs";
+        ar[2] = tmpArchive;
+        memcpy(ar + 3, objects, sizeof(char *) * numModules);
+        ar[numModules + 3] = NULL;
+        ok = Driver_run(ar, failure, sizeof(failure));
+        free(ar);
+    }
+    if (!ok)
+    {
+        printf("%s", failure);
+    } else if (rename(tmpArchive, archive) != 0)
+    {
+        printf("could not write %s", archive);
+        ok = false;
+    }
 
-            case tok_expose:
-                break;
+    unlink(tmpArchive);
+    for (size_t i = 0; i < numModules; i++)
+    {
+        unlink(objects[i]);
+        free(objects[i]);
+        free(modules[i]);
+        free(sources[i]);
+    }
+    rmdir(tmpDir);
+    free(objects);
+    free(drivers);
+    free(modules);
+    free(sources);
+    free(lengths);
+    if (!ok)
+    {
+        exit(-1);
+    }
+    return copyString(archive);
+}
 
-            default:
-                HandleTopLevelExpression();
-                break;
-        }
+// foo/bar.fc -> bar.o
+static char *objectName(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    base = base == NULL ? path : base + 1;
+    const char *dot = strrchr(base, '.');
+    size_t len = dot == NULL ? strlen(base) : (size_t)(dot - base);
+    char *name = malloc(len + 3);
+    if (name == NULL)
+    {
+        printf("error allocating memory");
+        exit(-1);
     }
+    memcpy(name, base, len);
+    strcpy(name + len, ".o");
+    return name;
 }
 
 int main(int argc, char* argv[]) {
-    fptr = fopen(argv[1], "r");
+    char *path = NULL;
+    char *outputPath = NULL;
+    bool compileOnly = false;
+    bool stats = false;
+    struct FuncocOptions options = { .backend = backend_qbe };
+    const char **imports = malloc(sizeof(char *) * argc);
+    if (imports == NULL)
+    {
+        printf("error allocating memory");
+        exit(-1);
+    }
+    options.imports = imports;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--stats") == 0)
+        {
+            stats = true;
+            atomic_store(&allocStatsEnabled, true);
+        } else if (strcmp(argv[i], "--il-stats") == 0)
+        {
+            options.ilStats = stderr;
+        } else if (strcmp(argv[i], "--instrument") == 0)
+        {
+            options.instrument = true;
+        } else if (strcmp(argv[i], "--profile-use") == 0 && i + 1 < argc)
+        {
+            options.profilePath = argv[++i];
+        } else if (strcmp(argv[i], "--import") == 0 && i + 1 < argc)
+        {
+            imports[options.numImports++] = argv[++i];
+        } else if (strcmp(argv[i], "--emit-interface") == 0 && i + 1 < argc)
+        {
+            options.interfacePath = argv[++i];
+        } else if (strcmp(argv[i], "-g") == 0)
+        {
+            options.debugInfo = true;
+        } else if (strcmp(argv[i], "--pipeline") == 0)
+        {
+            options.pipeline = true;
+        } else if (strcmp(argv[i], "--whole-program") == 0)
+        {
+            options.wholeProgram = true;
+        } else if (strcmp(argv[i], "--lex-threads") == 0 && i + 1 < argc)
+        {
+            options.lexThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-nesting") == 0 && i + 1 < argc)
+        {
+            options.maxNesting = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "x86") == 0)
+            {
+                options.backend = backend_x86;
+            } else if (strcmp(argv[i], "qbe") != 0)
+            {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "--stdlib") == 0 && i + 1 < argc)
+        {
+            options.stdlibDir = argv[++i];
+        } else if (strcmp(argv[i], "-c") == 0)
+        {
+            compileOnly = true;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            outputPath = argv[++i];
+        } else if (argv[i][0] == '-' || path != NULL)
+        {
+            usage(argv[0]);
+        } else
+        {
+            path = argv[i];
+        }
+    }
+
+    if (path == NULL)
+    {
+        usage(argv[0]);
+    }
 
-    if (fptr == NULL)
+    size_t len;
+    char *source = readFile(path, &len);
+    if (source == NULL)
     {
         printf("file not found.");
         exit(-1);
     }
 
-    getNextToken();
-
-    MainLoop();
+    struct Funcoc *ctx = Funcoc_new(&options);
+    if (ctx == NULL)
+    {
+        printf("error allocating memory");
+        exit(-1);
+    }
 
-    for (int i = 0; i < curLit; i++)
+    // without -c or -o the IL or assembly goes to stdout as before
+    FILE *out = stdout;
+    struct Driver driver = { .in = NULL, .inputFailed = false, .numStages = 0 };
+    char *archive = NULL;
+    char *defaultOutput = NULL;
+    if (compileOnly || outputPath != NULL)
     {
-        char *lit = *stringLiterals++;
-        printf("data $sl%d = { b \"%s\\0\" }\n", i, lit);
+        const char *as = Driver_tool("AS", "as");
+        const char *cc = Driver_tool("CC", "cc");
+        if (outputPath == NULL)
+        {
+            defaultOutput = objectName(path);
+            outputPath = defaultOutput;
+        }
+
+        if (compileOnly)
+        {
+            char *assemble[] = { (char *)as, "-o", outputPath, NULL };
+            Driver_start(&driver, options.backend == backend_qbe, assemble);
+        } else
+        {
+            // --whole-program output already holds the runtime it calls
+            if (!options.wholeProgram)
+            {
+                archive = Driver_runtimeArchive(options.stdlibDir != NULL ? options.stdlibDir : "stdlib", options.instrument);
+            }
+            char *link[] = { (char *)cc, "-o", outputPath, "-x", "assembler", "-", "-x", "none", archive, NULL };
+            Driver_start(&driver, options.backend == backend_qbe, link);
+        }
+        out = driver.in;
     }
 
-    for (Exp *exp = *Expressions++; ExpCount > 0; ExpCount--)
+    if (Funcoc_compile(ctx, path, source, len, writeStream, out) != 0)
+    {
+        if (driver.in != NULL)
+        {
+            Driver_abort(&driver);
+            unlink(outputPath);
+        }
+        printf("%s", Funcoc_error(ctx));
+        exit(-1);
+    }
+    if (driver.in != NULL)
     {
-        Exp_toIL(exp);
-        Exp_Free(exp);
+        char failure[DRIVER_FAILURE_MAX];
+        if (!Driver_finish(&driver, failure, sizeof(failure)))
+        {
+            printf("%s", failure);
+            unlink(outputPath);
+            exit(-1);
+        }
     }
+    free(source);
+    free(imports);
+    free(archive);
+    free(defaultOutput);
 
-    if (fptr != NULL)
+    if (stats)
     {
-        fclose(fptr);
+        Stats_report(ctx, stderr);
     }
+    Funcoc_free(ctx);
 
     return 0;
 }
-
+#endif
@@ -0,0 +1,59 @@
+#ifndef FUNCOC_H
+#define FUNCOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// libfuncoc: the compiler as a library. Build funcoc.c with
+// -DFUNCOC_NO_MAIN and link it into the host program.
+//
+// A Funcoc holds all the state of one compilation at a time. Separate
+// contexts share nothing but the allocation statistics, so any number of
+// them may compile concurrently on different threads.
+
+enum Backend
+{
+    backend_qbe,
+    backend_x86
+};
+
+// The command line flags, all off when zeroed. Strings are not copied and
+// must outlive the context.
+typedef struct FuncocOptions
+{
+    enum Backend backend;       // --backend
+    bool debugInfo;             // -g
+    bool instrument;            // --instrument
+    bool wholeProgram;          // --whole-program
+    bool pipeline;              // --pipeline
+    int lexThreads;             // --lex-threads, 0 picks by input size
+    int maxNesting;             // --max-nesting, 0 for the default of 1000
+    const char *stdlibDir;      // --stdlib, "stdlib" when NULL
+    const char *profilePath;    // --profile-use
+    const char **imports;       // --import, numImports interface files
+    int numImports;
+    const char *interfacePath;  // --emit-interface
+    FILE *ilStats;              // --il-stats is written here when set
+} FuncocOptions;
+
+// receives the generated QBE or assembly text, in order
+typedef void (*FuncocSink)(const char *data, size_t len, void *user);
+
+typedef struct Funcoc Funcoc;
+
+// NULL if out of memory
+struct Funcoc *Funcoc_new(const struct FuncocOptions *options);
+
+// Compiles len bytes of source, passing the output to sink. name is the
+// file name recorded in debug info and interface files. Returns 0, or -1
+// with the message in Funcoc_error; output already passed to the sink is
+// not taken back.
+int Funcoc_compile(struct Funcoc *ctx, const char *name, const char *source, size_t len, FuncocSink sink, void *user);
+
+// the message of the last failed compilation, "" if it succeeded
+const char *Funcoc_error(struct Funcoc *ctx);
+
+void Funcoc_free(struct Funcoc *ctx);
+
+#endif
@@ -0,0 +1,211 @@
+// Compiles the same programs on many threads at once, each thread with
+// its own contexts, and checks every result against the one a single
+// context gave before any thread started. Run by tests/run.sh:
+//
+//     concurrent file.fc...
+//
+// Each file is compiled with every entry of Modes, so --pipeline and
+// --lex-threads run their own threads under the callers'. Files that fail
+// to compile have to fail with the same message every time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "funcoc.h"
+
+#define THREADS 12
+#define ROUNDS 2
+
+static const struct FuncocOptions Modes[] =
+{
+    { .backend = backend_qbe },
+    { .backend = backend_qbe, .pipeline = true },
+    { .backend = backend_qbe, .lexThreads = 4 },
+    { .backend = backend_x86, .debugInfo = true },
+    { .backend = backend_x86, .pipeline = true, .lexThreads = 4 },
+};
+
+#define NUM_MODES (sizeof(Modes) / sizeof(Modes[0]))
+
+typedef struct Buffer
+{
+    char *data;
+    size_t size;
+    size_t allocated;
+} Buffer;
+
+typedef struct Source
+{
+    const char *path;
+    char *text;
+    size_t len;
+    struct Buffer expected[NUM_MODES];  // output, or the error message
+    int status[NUM_MODES];
+} Source;
+
+static struct Source *Sources;
+static int NumSources;
+
+static void Buffer_append(const char *data, size_t len, void *user)
+{
+    struct Buffer *buf = user;
+    if (buf->size + len > buf->allocated)
+    {
+        buf->allocated = (buf->size + len) * 2;
+        buf->data = realloc(buf->data, buf->allocated);
+        if (buf->data == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+}
+
+// compiles source i into out, returning Funcoc_compile's result
+static int compile(struct Funcoc *ctx, int i, struct Buffer *out)
+{
+    out->size = 0;
+    int status = Funcoc_compile(ctx, Sources[i].path, Sources[i].text, Sources[i].len, Buffer_append, out);
+    if (status != 0)
+    {
+        out->size = 0;
+        const char *error = Funcoc_error(ctx);
+        Buffer_append(error, strlen(error), out);
+    }
+    return status;
+}
+
+static void *run(void *arg)
+{
+    long thread = (long)arg;
+    struct Funcoc *contexts[NUM_MODES];
+    for (size_t m = 0; m < NUM_MODES; m++)
+    {
+        contexts[m] = Funcoc_new(&Modes[m]);
+        if (contexts[m] == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+
+    // every thread starts at a different file and mode, and reuses its
+    // contexts across files
+    struct Buffer out = { NULL, 0, 0 };
+    long failures = 0;
+    int total = NumSources * NUM_MODES;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (int k = 0; k < total; k++)
+        {
+            int job = (k + thread * 7) % total;
+            int i = job / NUM_MODES;
+            size_t m = job % NUM_MODES;
+            int status = compile(contexts[m], i, &out);
+            struct Buffer *expected = &Sources[i].expected[m];
+            if (status != Sources[i].status[m] || out.size != expected->size
+                || memcmp(out.data, expected->data, out.size) != 0)
+            {
+                fprintf(stderr, "thread %ld: %s in mode %zu differs from the single-threaded result\n",
+                        thread, Sources[i].path, m);
+                failures++;
+            }
+        }
+    }
+
+    free(out.data);
+    for (size_t m = 0; m < NUM_MODES; m++)
+    {
+        Funcoc_free(contexts[m]);
+    }
+    return (void *)failures;
+}
+
+static char *readFile(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    struct Buffer buf = { NULL, 0, 0 };
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        Buffer_append(chunk, n, &buf);
+    }
+    fclose(file);
+    *len = buf.size;
+    return buf.data != NULL ? buf.data : calloc(1, 1);
+}
+
+int main(int argc, char **argv)
+{
+    NumSources = argc - 1;
+    Sources = calloc(NumSources > 0 ? NumSources : 1, sizeof(struct Source));
+    if (Sources == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i < NumSources; i++)
+    {
+        Sources[i].path = argv[i + 1];
+        Sources[i].text = readFile(argv[i + 1], &Sources[i].len);
+        if (Sources[i].text == NULL)
+        {
+            fprintf(stderr, "%s not found\n", argv[i + 1]);
+            return 1;
+        }
+    }
+
+    // the reference results, one context at a time
+    for (size_t m = 0; m < NUM_MODES; m++)
+    {
+        struct Funcoc *ctx = Funcoc_new(&Modes[m]);
+        if (ctx == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        for (int i = 0; i < NumSources; i++)
+        {
+            Sources[i].status[m] = compile(ctx, i, &Sources[i].expected[m]);
+        }
+        Funcoc_free(ctx);
+    }
+
+    pthread_t threads[THREADS];
+    for (long t = 0; t < THREADS; t++)
+    {
+        if (pthread_create(&threads[t], NULL, run, (void *)t) != 0)
+        {
+            fprintf(stderr, "could not start thread %ld\n", t);
+            return 1;
+        }
+    }
+    long failures = 0;
+    for (int t = 0; t < THREADS; t++)
+    {
+        void *result;
+        pthread_join(threads[t], &result);
+        failures += (long)result;
+    }
+
+    for (int i = 0; i < NumSources; i++)
+    {
+        for (size_t m = 0; m < NUM_MODES; m++)
+        {
+            free(Sources[i].expected[m].data);
+        }
+        free(Sources[i].text);
+    }
+    free(Sources);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,6 @@
+twice 1000
+less 1000
+label 500
+loop 1000
+cold 1
+entry 1
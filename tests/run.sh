@@ -0,0 +1,171 @@
+#!/bin/sh
+# Regression checks for funcoc, run from the repository root:
+#
+#     tests/run.sh [--update]
+#
+# $FUNCOC is the compiler under test, ./funcoc by default (built with
+# cc -o funcoc funcoc.c -lbsd -lpthread). --update rewrites the golden
+# files from the current compiler instead of comparing against them.
+# $CC, cc by default, builds tests/concurrent.c against the library, with
+# $CFLAGS if set.
+#
+# Programs are only run when qbe is found ($QBE, or qbe from PATH): the
+# stdlib is QBE IL whichever backend compiles the program. With
+# REQUIRE_QBE=1 a missing qbe is a failure rather than a skip, for runs
+# that have to cover the full toolchain.
+
+FUNCOC=${FUNCOC:-./funcoc}
+update=false
+if [ "$1" = --update ]; then
+    update=true
+fi
+failures=0
+
+fail()
+{
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# compares the output in $1 against the golden file $2
+check()
+{
+    if $update; then
+        cp "$1" "$2"
+    elif ! cmp -s "$2" "$1"; then
+        fail "$2"
+        diff -u "$2" "$1" | head -20
+    fi
+}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+# a private runtime archive cache, built once per run
+export XDG_CACHE_HOME="$tmp/cache"
+
+# corpus: the --il-stats report of every program against its golden
+# .il-stats file, so codegen changes show up as metric diffs
+for src in tests/corpus/*.fc; do
+    if ! "$FUNCOC" --il-stats "$src" > /dev/null 2> "$tmp/il-stats"; then
+        fail "$src does not compile"
+    fi
+    check "$tmp/il-stats" "${src%.fc}.il-stats"
+done
+
+# --profile-use: every program with its .profile; the --il-stats report
+# shows which calls were inlined
+for src in tests/profile/*.fc; do
+    if ! "$FUNCOC" --il-stats --profile-use "${src%.fc}.profile" "$src" > /dev/null 2> "$tmp/il-stats"; then
+        fail "$src does not compile with its profile"
+    fi
+    check "$tmp/il-stats" "${src%.fc}.il-stats"
+done
+
+# errors: every program has to be rejected with the message in its
+# golden .err file
+for src in tests/errors/*.fc; do
+    if "$FUNCOC" "$src" > "$tmp/error" 2>&1; then
+        fail "$src compiles"
+    fi
+    check "$tmp/error" "${src%.fc}.err"
+done
+
+# --pipeline and parallel lexing: byte for byte the output of the
+# sequential compiler, on the corpus and on generated inputs that fill
+# the token ring and the lexer chunks many times over
+bench/gen.sh statements 30000 > "$tmp/statements.fc"
+bench/gen.sh functions 20000 > "$tmp/functions.fc"
+for src in tests/corpus/*.fc "$tmp/statements.fc" "$tmp/functions.fc"; do
+    for flags in "" -g "--backend x86" "--backend x86 -g"; do
+        "$FUNCOC" $flags "$src" > "$tmp/sequential" 2>&1
+        for mode in --pipeline "--lex-threads 4"; do
+            "$FUNCOC" $flags $mode "$src" > "$tmp/parallel" 2>&1
+            if ! cmp -s "$tmp/sequential" "$tmp/parallel"; then
+                fail "$src $flags $mode differs from the sequential output"
+            fi
+        done
+    done
+done
+
+# libfuncoc: separate contexts compiling the corpus, the errors and two
+# generated inputs on 12 threads at once, in every mode, against a
+# single-threaded run; built from funcoc.c with $CC
+bench/gen.sh statements 3000 > "$tmp/concurrent-statements.fc"
+bench/gen.sh functions 2000 > "$tmp/concurrent-functions.fc"
+if ! "${CC:-cc}" $CFLAGS -DFUNCOC_NO_MAIN -I. -o "$tmp/concurrent" tests/concurrent.c funcoc.c -lbsd -lpthread > "$tmp/build" 2>&1; then
+    fail "tests/concurrent.c does not build"
+    cat "$tmp/build"
+elif ! "$tmp/concurrent" tests/corpus/*.fc tests/errors/*.fc "$tmp/concurrent-statements.fc" "$tmp/concurrent-functions.fc"; then
+    fail "concurrent compilations differ from the single-threaded ones"
+fi
+
+# a literal past INT_MAX is an error from whichever lexer thread reads
+# it, here one well past the first chunk
+bench/gen.sh statements 200000 | sed '$d' > "$tmp/literal.fc"
+printf '    print(toString(123456789012));\n}\n' >> "$tmp/literal.fc"
+for mode in "" --pipeline "--lex-threads 4"; do
+    "$FUNCOC" $mode "$tmp/literal.fc" > "$tmp/error" 2>&1
+    if ! grep -q "integer literal too large" "$tmp/error"; then
+        fail "literal past INT_MAX accepted with '$mode'"
+    fi
+done
+
+# nesting: just under the limit compiles in every mode, far over it is a
+# compile error rather than a stack overflow
+bench/gen.sh nested 990 > "$tmp/nested.fc"
+bench/gen.sh nested 100000 > "$tmp/too-deep.fc"
+for flags in "" --whole-program --pipeline "--backend x86" -g; do
+    if ! "$FUNCOC" $flags "$tmp/nested.fc" > /dev/null 2>&1; then
+        fail "nesting under the limit does not compile with '$flags'"
+    fi
+    "$FUNCOC" $flags "$tmp/too-deep.fc" > "$tmp/error" 2>&1
+    status=$?
+    if [ $status -ne 255 ] || ! grep -q "expression nested too deeply" "$tmp/error"; then
+        fail "nesting over the limit with '$flags': status $status"
+    fi
+done
+# --max-nesting moves the limit
+bench/gen.sh nested 5000 > "$tmp/nested.fc"
+if "$FUNCOC" "$tmp/nested.fc" > /dev/null 2>&1; then
+    fail "nesting over the default limit compiles"
+fi
+if ! "$FUNCOC" --max-nesting 6000 "$tmp/nested.fc" > /dev/null 2>&1; then
+    fail "nesting under --max-nesting 6000 does not compile"
+fi
+
+# a tool that exits before reading all of its input is reported with its
+# exit status, instead of funcoc dying of SIGPIPE
+QBE=false AS=true "$FUNCOC" -c -o "$tmp/early.o" "$tmp/statements.fc" > "$tmp/early" 2>&1
+status=$?
+if [ $status -ne 255 ] || ! grep -q "false exited with status 1" "$tmp/early" || [ -e "$tmp/early.o" ]; then
+    fail "early tool exit: status $status, output: $(cat "$tmp/early")"
+fi
+
+# corpus and profile programs: every one built with both backends, linked
+# against the stdlib and run; the output of each has to match the golden
+# .out file
+if command -v "${QBE:-qbe}" > /dev/null; then
+    for src in tests/corpus/*.fc tests/profile/*.fc; do
+        profile=
+        if [ -e "${src%.fc}.profile" ]; then
+            profile="--profile-use ${src%.fc}.profile"
+        fi
+        for backend in qbe x86; do
+            if ! "$FUNCOC" --backend $backend $profile -o "$tmp/prog" "$src" > "$tmp/build" 2>&1; then
+                fail "$src does not build with --backend $backend"
+                cat "$tmp/build"
+                echo
+                continue
+            fi
+            "$tmp/prog" > "$tmp/out" 2>&1
+            check "$tmp/out" "${src%.fc}.out"
+        done
+    done
+elif [ -n "$REQUIRE_QBE" ]; then
+    fail "qbe not found (${QBE:-qbe}) and REQUIRE_QBE is set"
+else
+    echo "skip: qbe not found, corpus programs are not run"
+fi
+
+echo "$failures failed"
+[ $failures -eq 0 ]